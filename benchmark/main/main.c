@@ -0,0 +1,294 @@
+/* Benchmark of ESP-IDF net-logging on the linux target
+ *
+ * This sample code is in the public domain.
+ */
+
+#define _GNU_SOURCE // for memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "net_logging.h"
+
+#if !CONFIG_IDF_TARGET_LINUX
+#error "The benchmark runs on the linux target, see README.md"
+#endif
+
+static const char *TAG = "BENCH";
+
+// Latency samples kept per receiver, later ones replace random earlier ones
+#define BENCH_SAMPLES (1 << 18)
+
+// Each message starts with this, followed by the producer, the sequence number and the esp_timer of the call
+#define BENCH_MARKER "bench "
+
+typedef struct {
+	int index;
+	uint32_t calls;
+	int64_t call_ns;     // time spent in ESP_LOGI
+	TaskHandle_t taskHandle;
+} PRODUCER_t;
+
+// The receivers are host threads, not FreeRTOS tasks, so that they run next to the scheduler
+// and a blocking recv() doesn't stop the sinks. They only use esp_timer_get_time() of the IDF.
+typedef struct {
+	const char *name;
+	int sink;
+	int sock;
+	volatile bool stop;
+	uint32_t received;
+	uint32_t samples_len;
+	uint32_t random;
+	int64_t *samples;
+	pthread_t thread;
+} RECEIVER_t;
+
+static PRODUCER_t producers[CONFIG_BENCH_PRODUCERS];
+
+static void receiver_add(RECEIVER_t *receiver, int64_t latency) {
+	// Reservoir sampling, so that a long run still gives the percentiles of the whole run
+	uint32_t slot = receiver->received++;
+	if (slot >= BENCH_SAMPLES) {
+		receiver->random = receiver->random * 1103515245 + 12345;
+		slot = receiver->random % receiver->received;
+		if (slot >= BENCH_SAMPLES) return;
+	} else {
+		receiver->samples_len++;
+	}
+	receiver->samples[slot] = latency;
+}
+
+// Find the messages of the producers in data, text or binary records alike.
+// Returns the bytes that have been used, the rest may be the start of a message.
+static size_t receiver_scan(RECEIVER_t *receiver, const char *data, size_t len, int64_t now) {
+	const size_t marker_len = strlen(BENCH_MARKER);
+	size_t offset = 0;
+	while (1) {
+		const char *marker = memmem(data + offset, len - offset, BENCH_MARKER, marker_len);
+		if (marker == NULL) {
+			return (len - offset >= marker_len) ? len - marker_len + 1 : offset;
+		}
+
+		// The numbers end with the third space
+		const char *end = marker + marker_len;
+		int spaces = 0;
+		while (end < data + len && spaces < 3) {
+			if (*end++ == ' ') spaces++;
+		}
+		if (spaces < 3) return marker - data;
+		offset = end - data;
+
+		char text[64];
+		size_t text_len = end - marker;
+		if (text_len >= sizeof(text)) continue;
+		memcpy(text, marker, text_len);
+		text[text_len] = 0;
+		int producer;
+		uint32_t seq;
+		int64_t timestamp;
+		if (sscanf(text, BENCH_MARKER "%d %"SCNu32" %"SCNd64, &producer, &seq, &timestamp) != 3) continue;
+		receiver_add(receiver, now - timestamp);
+	}
+}
+
+static void *udp_receiver(void *arg) {
+	RECEIVER_t *receiver = arg;
+	char buffer[xItemSize];
+	while (!receiver->stop) {
+		ssize_t len = recv(receiver->sock, buffer, sizeof(buffer), 0);
+		if (len <= 0) continue;
+		receiver_scan(receiver, buffer, len, esp_timer_get_time());
+	}
+	return NULL;
+}
+
+static void *tcp_receiver(void *arg) {
+	RECEIVER_t *receiver = arg;
+	int sock = -1;
+	while (sock < 0 && !receiver->stop) {
+		sock = accept(receiver->sock, NULL, NULL);
+	}
+	if (sock < 0) return NULL;
+	struct timeval timeout = { .tv_usec = 100000 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char buffer[4096];
+	size_t buffer_len = 0;
+	while (!receiver->stop) {
+		ssize_t len = recv(sock, buffer + buffer_len, sizeof(buffer) - buffer_len, 0);
+		if (len <= 0) continue;
+		buffer_len += len;
+		size_t used = receiver_scan(receiver, buffer, buffer_len, esp_timer_get_time());
+		if (used == 0 && buffer_len == sizeof(buffer)) used = buffer_len;
+		memmove(buffer, &buffer[used], buffer_len - used);
+		buffer_len -= used;
+	}
+	close(sock);
+	return NULL;
+}
+
+static esp_err_t receiver_start(RECEIVER_t *receiver, const char *name, int sink, int type, int port, void *(*thread)(void *)) {
+	memset(receiver, 0, sizeof(RECEIVER_t));
+	receiver->name = name;
+	receiver->sink = sink;
+	receiver->random = port;
+	receiver->samples = malloc(BENCH_SAMPLES * sizeof(int64_t));
+	receiver->sock = socket(AF_INET, type, 0);
+	if (receiver->samples == NULL || receiver->sock < 0) return ESP_FAIL;
+
+	int on = 1;
+	setsockopt(receiver->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	int rcvbuf = 4 * 1024 * 1024;
+	setsockopt(receiver->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct timeval timeout = { .tv_usec = 100000 };
+	setsockopt(receiver->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (bind(receiver->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("%s receiver: port %d is in use\n", name, port);
+		return ESP_FAIL;
+	}
+	if (type == SOCK_STREAM) listen(receiver->sock, 1);
+	if (pthread_create(&receiver->thread, NULL, thread, receiver) != 0) return ESP_FAIL;
+	return ESP_OK;
+}
+
+static int compare_latency(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t *samples, uint32_t len, int percent) {
+	if (len == 0) return -1;
+	return samples[(uint64_t)(len - 1) * percent / 100];
+}
+
+static void producer(void *pvParameters) {
+	PRODUCER_t *self = pvParameters;
+	char padding[CONFIG_BENCH_MESSAGE_SIZE + 1];
+	memset(padding, 'x', CONFIG_BENCH_MESSAGE_SIZE);
+	padding[CONFIG_BENCH_MESSAGE_SIZE] = 0;
+
+	int64_t start = esp_timer_get_time();
+	int64_t end = start + CONFIG_BENCH_DURATION * 1000000LL;
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		if (now >= end) break;
+#if CONFIG_BENCH_RATE > 0
+		int64_t due = start + (int64_t)self->calls * 1000000 / CONFIG_BENCH_RATE;
+		if (now < due) {
+			vTaskDelay(1);
+			continue;
+		}
+#endif
+		// The marker and numbers take up about 30 bytes of the message
+		char head[48];
+		int head_len = snprintf(head, sizeof(head), BENCH_MARKER "%d %"PRIu32" %"PRId64" ", self->index, self->calls, now);
+		int pad_len = CONFIG_BENCH_MESSAGE_SIZE - head_len;
+		if (pad_len < 0) pad_len = 0;
+		ESP_LOGI(TAG, "%s%.*s", head, pad_len, padding);
+		self->call_ns += (esp_timer_get_time() - now) * 1000;
+		self->calls++;
+#if CONFIG_BENCH_RATE == 0
+		// Let the sinks of the same priority run
+		if ((self->calls % 64) == 0) taskYIELD();
+#endif
+	}
+	xTaskNotifyGive(self->taskHandle);
+	vTaskDelete(NULL);
+}
+
+void app_main()
+{
+	RECEIVER_t receivers[2];
+	int receivers_len = 0;
+
+	// The receivers have to be up before the sinks start
+#if CONFIG_ENABLE_UDP_LOG
+	ESP_ERROR_CHECK(receiver_start(&receivers[receivers_len++], "udp", NET_LOGGING_UDP, SOCK_DGRAM, CONFIG_LOG_UDP_SERVER_PORT, udp_receiver));
+	ESP_ERROR_CHECK(udp_logging_init( CONFIG_LOG_UDP_SERVER_IP, CONFIG_LOG_UDP_SERVER_PORT, 0 ));
+#endif
+#if CONFIG_ENABLE_TCP_LOG
+	ESP_ERROR_CHECK(receiver_start(&receivers[receivers_len++], "tcp", NET_LOGGING_TCP, SOCK_STREAM, CONFIG_LOG_TCP_SERVER_PORT, tcp_receiver));
+	ESP_ERROR_CHECK(tcp_logging_init( CONFIG_LOG_TCP_SERVER_IP, CONFIG_LOG_TCP_SERVER_PORT, 0 ));
+#endif
+#if CONFIG_ENABLE_FILE_LOG
+	ESP_ERROR_CHECK(file_logging_init( CONFIG_LOG_FILE_DIRECTORY, 0 ));
+#endif
+	printf("producers=%d rate=%d message_size=%d duration=%d\n",
+		CONFIG_BENCH_PRODUCERS, CONFIG_BENCH_RATE, CONFIG_BENCH_MESSAGE_SIZE, CONFIG_BENCH_DURATION);
+
+	NET_LOGGING_STATS_t before;
+	net_logging_get_stats(&before);
+	for (int i = 0; i < CONFIG_BENCH_PRODUCERS; i++) {
+		producers[i].index = i;
+		producers[i].taskHandle = xTaskGetCurrentTaskHandle();
+		char name[16];
+		snprintf(name, sizeof(name), "PRODUCER%d", i);
+		xTaskCreate(producer, name, 1024*4, &producers[i], CONFIG_BENCH_PRIORITY, NULL);
+	}
+	for (int i = 0; i < CONFIG_BENCH_PRODUCERS; i++) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+
+	// Give the sinks and the receivers time to catch up
+	net_logging_flush(pdMS_TO_TICKS(5000));
+	vTaskDelay(pdMS_TO_TICKS(500));
+	NET_LOGGING_STATS_t after;
+	net_logging_get_stats(&after);
+	for (int i = 0; i < receivers_len; i++) {
+		receivers[i].stop = true;
+		pthread_join(receivers[i].thread, NULL);
+	}
+
+	uint32_t calls = 0;
+	int64_t call_ns = 0;
+	for (int i = 0; i < CONFIG_BENCH_PRODUCERS; i++) {
+		calls += producers[i].calls;
+		call_ns += producers[i].call_ns;
+	}
+	double seconds = CONFIG_BENCH_DURATION;
+
+	// One JSON object per line, the lines that start with '{' are the results
+	printf("{\"producers\":%d,\"rate\":%d,\"message_size\":%d,\"duration_s\":%d,\"calls\":%"PRIu32",\"ns_per_call\":%.0f,\"calls_per_s\":%.0f}\n",
+		CONFIG_BENCH_PRODUCERS, CONFIG_BENCH_RATE, CONFIG_BENCH_MESSAGE_SIZE, CONFIG_BENCH_DURATION,
+		calls, calls ? (double)call_ns / calls : 0.0, calls / seconds);
+	for (int i = 0; i < receivers_len; i++) {
+		RECEIVER_t *receiver = &receivers[i];
+		NET_LOGGING_SINK_STATS_t *stats = &after.sink[receiver->sink];
+		uint32_t dropped = stats->dropped - before.sink[receiver->sink].dropped;
+		qsort(receiver->samples, receiver->samples_len, sizeof(int64_t), compare_latency);
+		printf("{\"sink\":\"%s\",\"received\":%"PRIu32",\"records_per_s\":%.0f,\"p50_us\":%"PRId64",\"p99_us\":%"PRId64
+			",\"max_us\":%"PRId64",\"buffer_dropped\":%"PRIu32",\"drop_rate\":%.6f,\"high_water\":%"PRIu32"}\n",
+			receiver->name, receiver->received, receiver->received / seconds,
+			percentile(receiver->samples, receiver->samples_len, 50),
+			percentile(receiver->samples, receiver->samples_len, 99),
+			percentile(receiver->samples, receiver->samples_len, 100),
+			dropped, calls ? 1.0 - (double)receiver->received / calls : 0.0, stats->high_water);
+	}
+#if CONFIG_ENABLE_FILE_LOG
+	// Nothing reads the files back, so the file sink only has the counters of the component
+	NET_LOGGING_SINK_STATS_t *file = &after.sink[NET_LOGGING_FILE];
+	printf("{\"sink\":\"file\",\"written\":%"PRIu32",\"records_per_s\":%.0f,\"buffer_dropped\":%"PRIu32",\"drop_rate\":%.6f,\"high_water\":%"PRIu32"}\n",
+		file->sent - before.sink[NET_LOGGING_FILE].sent, (file->sent - before.sink[NET_LOGGING_FILE].sent) / seconds,
+		file->dropped - before.sink[NET_LOGGING_FILE].dropped,
+		calls ? (double)(file->dropped - before.sink[NET_LOGGING_FILE].dropped) / calls : 0.0, file->high_water);
+#endif
+	fflush(stdout);
+	exit(0);
+}
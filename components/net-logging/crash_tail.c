@@ -0,0 +1,221 @@
+/*
+	Crash tail
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+#include "net_logging.h"
+#include "log_record.h"
+
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+
+#define CRASH_TAIL_MAGIC 0x4c4f4754 // "LOGT"
+
+// Each log is kept as an entry: a 5 byte header, then the payload.
+// uint16  length of the payload
+// uint8   CRASH_TAIL_TEXT, or CRASH_TAIL_RECORD
+// uint16  Fletcher-16 of the length, the kind and the payload
+// A text entry is the line as it was sent.
+// A record entry is the length of the tag, the tag, then the binary record, as the tag ID is not valid after the reset.
+#define CRASH_TAIL_HEADER 5
+#define CRASH_TAIL_TEXT 1
+#define CRASH_TAIL_RECORD 2
+// Same as LOG_RECORD_TAG_MAX
+#define CRASH_TAIL_TAG_MAX 32
+
+// The most recent logs are copied into RAM that is not cleared by a panic, watchdog or brownout reset.
+// The oldest entries are removed whole to make room, so the ring always starts with a header.
+// Power-on leaves random data in this RAM, which fails the checks.
+typedef struct {
+	uint32_t magic;
+	uint32_t head;  // offset where the next entry is written
+	uint32_t used;  // bytes of entries in the ring
+	uint32_t check; // magic ^ head ^ used ^ ~size
+	uint8_t data[CONFIG_NET_LOGGING_CRASH_TAIL_SIZE];
+} CRASH_TAIL_t;
+
+static RTC_NOINIT_ATTR CRASH_TAIL_t crash_tail;
+static portMUX_TYPE crash_tail_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Entries of the previous boot that passed the checks, oldest first, taken out of the ring by crash_tail_init()
+static uint8_t *crash_tail_copy;
+static size_t crash_tail_len;
+static const char *crash_tail_reason;
+static bool crash_tail_started;
+
+static uint32_t crash_tail_check(uint32_t head, uint32_t used) {
+	return CRASH_TAIL_MAGIC ^ head ^ used ^ ~(uint32_t)CONFIG_NET_LOGGING_CRASH_TAIL_SIZE;
+}
+
+// Byte of the ring at an offset that may have wrapped
+static uint8_t *crash_tail_at(size_t offset) {
+	return &crash_tail.data[offset % CONFIG_NET_LOGGING_CRASH_TAIL_SIZE];
+}
+
+static void crash_tail_sum(uint16_t *sum1, uint16_t *sum2, uint8_t byte) {
+	*sum1 = (*sum1 + byte) % 255;
+	*sum2 = (*sum2 + *sum1) % 255;
+}
+
+// Copy prefix and data into the ring as one entry
+static void crash_tail_put(uint8_t kind, const uint8_t *prefix, size_t prefix_len, const uint8_t *data, size_t len) {
+	size_t payload = prefix_len + len;
+	size_t need = CRASH_TAIL_HEADER + payload;
+	if (payload > UINT16_MAX || need > CONFIG_NET_LOGGING_CRASH_TAIL_SIZE) return;
+
+	portENTER_CRITICAL_SAFE(&crash_tail_lock);
+	uint32_t head = crash_tail.head;
+	uint32_t used = crash_tail.used;
+	// Remove the oldest entries until there is room
+	while (used + need > CONFIG_NET_LOGGING_CRASH_TAIL_SIZE) {
+		size_t tail = head + CONFIG_NET_LOGGING_CRASH_TAIL_SIZE - used;
+		size_t entry = CRASH_TAIL_HEADER + (*crash_tail_at(tail) | *crash_tail_at(tail + 1) << 8);
+		used = (entry < used) ? used - entry : 0;
+	}
+
+	uint16_t sum1 = 0;
+	uint16_t sum2 = 0;
+	crash_tail_sum(&sum1, &sum2, payload & 0xff);
+	crash_tail_sum(&sum1, &sum2, payload >> 8);
+	crash_tail_sum(&sum1, &sum2, kind);
+	size_t offset = head + CRASH_TAIL_HEADER;
+	for (size_t i = 0; i < payload; i++) {
+		uint8_t byte = (i < prefix_len) ? prefix[i] : data[i - prefix_len];
+		*crash_tail_at(offset++) = byte;
+		crash_tail_sum(&sum1, &sum2, byte);
+	}
+	*crash_tail_at(head) = payload & 0xff;
+	*crash_tail_at(head + 1) = payload >> 8;
+	*crash_tail_at(head + 2) = kind;
+	*crash_tail_at(head + 3) = sum1;
+	*crash_tail_at(head + 4) = sum2;
+
+	head = (head + need) % CONFIG_NET_LOGGING_CRASH_TAIL_SIZE;
+	used += need;
+	crash_tail.head = head;
+	crash_tail.used = used;
+	crash_tail.check = crash_tail_check(head, used);
+	portEXIT_CRITICAL_SAFE(&crash_tail_lock);
+}
+
+// Called from logging_vprintf() with the text of a log
+void crash_tail_text(const char *text, size_t len) {
+	crash_tail_put(CRASH_TAIL_TEXT, NULL, 0, (const uint8_t *)text, len);
+}
+
+// Called from logging_vprintf() with the binary record of a log that was not turned into text
+void crash_tail_record(const char *tag, const uint8_t *record, size_t len) {
+	uint8_t prefix[1 + CRASH_TAIL_TAG_MAX];
+	if (tag == NULL) tag = "";
+	size_t tag_len = strnlen(tag, sizeof(prefix) - 1);
+	prefix[0] = tag_len;
+	memcpy(&prefix[1], tag, tag_len);
+	crash_tail_put(CRASH_TAIL_RECORD, prefix, 1 + tag_len, record, len);
+}
+
+// Take the logs of the previous boot out of the ring, if it ended with a panic, a watchdog or a brownout,
+// and start recording this boot. Only the first call does anything.
+void crash_tail_init(void) {
+	if (crash_tail_started) return;
+	crash_tail_started = true;
+
+	esp_reset_reason_t reason = esp_reset_reason();
+	if (reason == ESP_RST_PANIC) {
+		crash_tail_reason = "panic";
+	} else if (reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT || reason == ESP_RST_WDT) {
+		crash_tail_reason = "watchdog";
+	} else if (reason == ESP_RST_BROWNOUT) {
+		// The RAM may not have kept its data, the checks drop what it lost
+		crash_tail_reason = "brownout";
+	}
+
+	bool valid = (crash_tail.magic == CRASH_TAIL_MAGIC &&
+		crash_tail.head < CONFIG_NET_LOGGING_CRASH_TAIL_SIZE &&
+		crash_tail.used <= CONFIG_NET_LOGGING_CRASH_TAIL_SIZE &&
+		crash_tail.check == crash_tail_check(crash_tail.head, crash_tail.used));
+	if (crash_tail_reason != NULL && valid && crash_tail.used > 0) {
+		crash_tail_copy = malloc(crash_tail.used);
+	}
+	if (crash_tail_copy != NULL) {
+		// Oldest entry first, up to the first one that fails its checks, e.g. torn by the crash
+		size_t tail = crash_tail.head + CONFIG_NET_LOGGING_CRASH_TAIL_SIZE - crash_tail.used;
+		size_t pos = 0;
+		while (pos + CRASH_TAIL_HEADER <= crash_tail.used) {
+			for (size_t i = 0; i < CRASH_TAIL_HEADER; i++) {
+				crash_tail_copy[pos + i] = *crash_tail_at(tail + pos + i);
+			}
+			uint8_t *header = &crash_tail_copy[pos];
+			size_t payload = header[0] | header[1] << 8;
+			if (header[2] != CRASH_TAIL_TEXT && header[2] != CRASH_TAIL_RECORD) break;
+			if (pos + CRASH_TAIL_HEADER + payload > crash_tail.used) break;
+			uint16_t sum1 = 0;
+			uint16_t sum2 = 0;
+			crash_tail_sum(&sum1, &sum2, header[0]);
+			crash_tail_sum(&sum1, &sum2, header[1]);
+			crash_tail_sum(&sum1, &sum2, header[2]);
+			for (size_t i = 0; i < payload; i++) {
+				uint8_t byte = *crash_tail_at(tail + pos + CRASH_TAIL_HEADER + i);
+				crash_tail_copy[pos + CRASH_TAIL_HEADER + i] = byte;
+				crash_tail_sum(&sum1, &sum2, byte);
+			}
+			if (header[3] != sum1 || header[4] != sum2) break;
+			pos += CRASH_TAIL_HEADER + payload;
+		}
+		crash_tail_len = pos;
+		if (pos < crash_tail.used) {
+			printf("crash tail: %d bytes failed the check\n", (int)(crash_tail.used - pos));
+		}
+		printf("crash tail: %d bytes of logs before the %s\n", (int)crash_tail_len, crash_tail_reason);
+	}
+
+	portENTER_CRITICAL_SAFE(&crash_tail_lock);
+	crash_tail.magic = CRASH_TAIL_MAGIC;
+	crash_tail.head = 0;
+	crash_tail.used = 0;
+	crash_tail.check = crash_tail_check(0, 0);
+	portEXIT_CRITICAL_SAFE(&crash_tail_lock);
+}
+
+// Why the previous boot ended, NULL if it did not end with a crash or no logs were kept
+const char *crash_tail_reason_get(void) {
+	return (crash_tail_len > 0) ? crash_tail_reason : NULL;
+}
+
+// The log of the previous boot at *pos as a line of text, records are turned back into text.
+// Start with *pos at 0. Returns false after the last log.
+bool crash_tail_line(size_t *pos, char *line, size_t size) {
+	while (*pos + CRASH_TAIL_HEADER <= crash_tail_len) {
+		const uint8_t *header = &crash_tail_copy[*pos];
+		size_t payload = header[0] | header[1] << 8;
+		const uint8_t *data = header + CRASH_TAIL_HEADER;
+		*pos += CRASH_TAIL_HEADER + payload;
+
+		size_t len = 0;
+		if (header[2] == CRASH_TAIL_TEXT) {
+			len = (payload < size - 1) ? payload : size - 1;
+			memcpy(line, data, len);
+		} else if (payload > 0 && data[0] < payload && data[0] <= CRASH_TAIL_TAG_MAX) {
+			char tag[CRASH_TAIL_TAG_MAX + 1];
+			memcpy(tag, &data[1], data[0]);
+			tag[data[0]] = 0;
+			len = log_record_text(line, size, &data[1 + data[0]], payload - 1 - data[0], tag);
+		}
+		if (len == 0) continue;
+		line[len] = 0;
+		return true;
+	}
+	return false;
+}
+#endif
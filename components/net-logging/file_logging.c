@@ -0,0 +1,387 @@
+/*
+	File logging
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h> // for unlink()
+#include <sys/stat.h> // for mkdir()
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+#include "freertos/ringbuf.h"
+#else
+#include "freertos/message_buffer.h"
+#endif
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_LOG_FILE_UPLOAD
+#include "esp_http_client.h"
+#endif
+
+#include "net_logging.h"
+#include "log_record.h"
+
+#ifndef CONFIG_LOG_FILE_MAX_SIZE
+#define CONFIG_LOG_FILE_MAX_SIZE 16384
+#endif
+#ifndef CONFIG_LOG_FILE_MAX_FILES
+#define CONFIG_LOG_FILE_MAX_FILES 4
+#endif
+#ifndef CONFIG_LOG_FILE_BATCH_SIZE
+#define CONFIG_LOG_FILE_BATCH_SIZE 1024
+#endif
+#ifndef CONFIG_LOG_FILE_FLUSH_INTERVAL
+#define CONFIG_LOG_FILE_FLUSH_INTERVAL 5
+#endif
+
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
+#else
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
+#endif
+
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+void logging_stats_dropped(int sink, uint32_t records);
+void logging_ready(int sink, TaskHandle_t taskHandle);
+void logging_failed(int sink);
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void));
+
+// Logs are appended to <directory>/log.<n>, where n counts up.
+// A file is closed before it grows over CONFIG_LOG_FILE_MAX_SIZE bytes and the oldest file is removed
+// when there are more than CONFIG_LOG_FILE_MAX_FILES.
+// Logs are collected in RAM and written CONFIG_LOG_FILE_BATCH_SIZE bytes at a time,
+// or CONFIG_LOG_FILE_FLUSH_INTERVAL seconds after the first one, to limit flash wear.
+static char file_directory[64];
+static volatile uint32_t file_first;    // number of the oldest file
+static volatile uint32_t file_current;  // number of the file being written
+static volatile bool file_rotate_request;
+// file_first is moved by the writer when it prunes, and by the uploader when it has sent a file
+static portMUX_TYPE file_lock = portMUX_INITIALIZER_UNLOCKED;
+static char file_batch[CONFIG_LOG_FILE_BATCH_SIZE];
+// The state of the writer, also used by net_logging_flush() while the writer is parked
+static FILE *file_stream;
+static size_t file_size;   // bytes in the current file, a binary file starts with definitions
+static size_t file_logged; // bytes of logs in the current file
+static size_t batch_len;
+static uint32_t batch_records;
+static int64_t batch_timer; // esp_timer when the oldest log of the batch was taken out of the buffer
+#if CONFIG_LOG_FILE_BINARY
+// Tags defined in the current file
+static LOG_RECORD_TAGS_t file_tags;
+#endif
+
+static void file_path(char *path, size_t size, uint32_t number) {
+	snprintf(path, size, "%s/log.%"PRIu32, file_directory, number);
+}
+
+// Find the log files left from the previous run
+static void file_scan(void) {
+	bool found = false;
+	uint32_t first = 0;
+	uint32_t last = 0;
+	DIR *dir = opendir(file_directory);
+	if (dir != NULL) {
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (strncmp(entry->d_name, "log.", 4) != 0) continue;
+			char *end;
+			uint32_t number = strtoul(&entry->d_name[4], &end, 10);
+			if (end == &entry->d_name[4] || *end != 0) continue;
+			if (!found || number < first) first = number;
+			if (!found || number > last) last = number;
+			found = true;
+		}
+		closedir(dir);
+	}
+	file_first = first;
+	// The last file may end with a partial line, so start a new one
+	file_current = found ? last + 1 : 0;
+}
+
+static FILE *file_open(uint32_t number) {
+	char path[80];
+	file_path(path, sizeof(path), number);
+	FILE *file = fopen(path, "a");
+	if (file == NULL) {
+		printf("Failed to open %s\n", path);
+	}
+	return file;
+}
+
+// Remove a file that is no longer needed, the oldest one moves on when it is that one
+static void file_remove(uint32_t number) {
+	taskENTER_CRITICAL(&file_lock);
+	if (number == file_first) file_first++;
+	taskEXIT_CRITICAL(&file_lock);
+	char path[80];
+	file_path(path, sizeof(path), number);
+	unlink(path);
+}
+
+// Remove the oldest files, so that there are no more than CONFIG_LOG_FILE_MAX_FILES with the current one
+static void file_prune(void) {
+	while (file_current - file_first >= CONFIG_LOG_FILE_MAX_FILES) {
+		file_remove(file_first);
+	}
+}
+
+// Close the current file and continue in a new one
+static FILE *file_rotate(FILE *file) {
+	fclose(file);
+	file_current++;
+	file_prune();
+	file = file_open(file_current);
+	file_size = 0;
+#if CONFIG_LOG_FILE_BINARY
+	// Each file can be decoded on its own, so it starts with the time and the tags defined in the previous ones.
+	// The batch about to be written may use them.
+	if (file != NULL) {
+		uint8_t time[LOG_RECORD_DEFINE_SIZE];
+		size_t time_len = log_record_time(time, sizeof(time), &file_tags.time_version);
+		file_size += fwrite(time, 1, time_len, file);
+		for (uint32_t id = log_record_tags_next(&file_tags, 0); id != 0; id = log_record_tags_next(&file_tags, id)) {
+			uint8_t definition[LOG_RECORD_DEFINE_SIZE];
+			size_t definition_len = log_record_define(definition, sizeof(definition), id);
+			file_size += fwrite(definition, 1, definition_len, file);
+		}
+	}
+#endif
+	return file;
+}
+
+// Write the batch to the current file
+static void file_write_batch(void) {
+	if (batch_len == 0) return;
+	if (fwrite(file_batch, 1, batch_len, file_stream) != batch_len || fflush(file_stream) != 0) {
+		printf("Failed to write log file\n");
+		logging_stats_dropped(NET_LOGGING_FILE, batch_records);
+	} else {
+		logging_stats_sent(NET_LOGGING_FILE, batch_records, batch_len, batch_timer);
+		file_size += batch_len;
+		file_logged += batch_len;
+	}
+	batch_len = 0;
+	batch_records = 0;
+}
+
+// Called by net_logging_flush() for each queued log. The batch goes first, so the logs stay in order.
+// The current file is not rotated, it may go over CONFIG_LOG_FILE_MAX_SIZE by these logs.
+static bool file_flush_send(const void *data, size_t len) {
+	file_write_batch();
+#if CONFIG_LOG_FILE_BINARY
+	char item[LOG_RECORD_DEFINE_SIZE + xItemSize];
+	size_t definition_len = log_record_tags_check(&file_tags, data, len, (uint8_t *)item, LOG_RECORD_DEFINE_SIZE);
+	if (definition_len > 0) {
+		memcpy(&item[definition_len], data, len);
+		len += definition_len;
+		data = item;
+	}
+#endif
+	if (fwrite(data, 1, len, file_stream) != len) return false;
+	file_size += len;
+	file_logged += len;
+	return true;
+}
+
+// Called by net_logging_flush() after the queued logs, so that they are on the file system before a restart
+static void file_flush_finish(void) {
+	file_write_batch();
+	fflush(file_stream);
+}
+
+// File Writer Task
+void file_writer(void *pvParameters) {
+	PARAMETER_t *task_parameter = pvParameters;
+	PARAMETER_t param;
+	memcpy((char *)&param, task_parameter, sizeof(PARAMETER_t));
+	//printf("Start:param.path=[%s]\n", param.path);
+
+	strcpy(file_directory, param.path);
+	// Needed on the linux target, on SPIFFS the mount point is the directory
+	mkdir(file_directory, 0755);
+	file_scan();
+	file_prune();
+	file_stream = file_open(file_current);
+	if (file_stream == NULL) {
+		logging_failed(NET_LOGGING_FILE);
+		vTaskDelete(NULL);
+	}
+	file_size = 0;
+#if CONFIG_LOG_FILE_BINARY
+	log_record_tags_init(&file_tags, 0);
+#endif
+
+	logging_flusher(NET_LOGGING_FILE, file_flush_send, file_flush_finish);
+	logging_ready(NET_LOGGING_FILE, param.taskHandle);
+
+	file_logged = 0;
+	batch_len = 0;
+	batch_records = 0;
+	TickType_t batch_start = 0;
+	const TickType_t flush_interval = pdMS_TO_TICKS(CONFIG_LOG_FILE_FLUSH_INTERVAL * 1000);
+	while(1) {
+		// Wait no longer than the oldest log in the batch is allowed to stay in RAM
+		TickType_t xTicksToWait = flush_interval;
+		if (batch_len > 0) {
+			TickType_t elapsed = xTaskGetTickCount() - batch_start;
+			xTicksToWait = (elapsed < flush_interval) ? flush_interval - elapsed : 0;
+		}
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+		size_t received = 0;
+		RingbufHandle_t from;
+		char *buffer = (char *)logging_receive(NET_LOGGING_FILE, &received, xTicksToWait, &from);
+		if (buffer == NULL) received = 0;
+#else
+		char buffer[xItemSize];
+		size_t received = logging_receive(NET_LOGGING_FILE, buffer, sizeof(buffer), xTicksToWait);
+#endif
+
+		const char *data = buffer;
+#if CONFIG_LOG_FILE_BINARY
+		// The definition of a new tag goes in front of the record
+		char item[LOG_RECORD_DEFINE_SIZE + xItemSize];
+		if (received > 0) {
+			size_t definition_len = log_record_tags_check(&file_tags, (uint8_t *)buffer, received, (uint8_t *)item, LOG_RECORD_DEFINE_SIZE);
+			if (definition_len > 0) {
+				memcpy(&item[definition_len], buffer, received);
+				received += definition_len;
+				data = item;
+			}
+		}
+#endif
+
+		bool flush = (received == 0);
+		if (received > 0) {
+			if (batch_len + received > sizeof(file_batch)) {
+				// Write what we have, this log starts the next batch
+				flush = true;
+			} else {
+				if (batch_len == 0) {
+					batch_start = xTaskGetTickCount();
+					batch_timer = esp_timer_get_time();
+				}
+				memcpy(&file_batch[batch_len], data, received);
+				batch_len += received;
+				batch_records++;
+				received = 0;
+				flush = (batch_len == sizeof(file_batch));
+			}
+		}
+
+		// Start a new file when the batch would take the current one over the size limit,
+		// or when the uploader wants the logs written so far and there are any
+		if ((flush && file_size > 0 && file_size + batch_len > CONFIG_LOG_FILE_MAX_SIZE) ||
+			(file_rotate_request && file_logged > 0)) {
+			file_stream = file_rotate(file_stream);
+			if (file_stream == NULL) {
+				// The batch and the log that did not fit into it are lost with the sink
+				logging_stats_dropped(NET_LOGGING_FILE, batch_records + (received > 0 ? 1 : 0));
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+				if (buffer != NULL) vRingbufferReturnItem(from, (void *)buffer);
+#endif
+				break;
+			}
+			file_logged = 0;
+		}
+		file_rotate_request = false;
+
+		if (flush) file_write_batch();
+
+		// A log that did not fit into the previous batch
+		if (received > 0) {
+			batch_start = xTaskGetTickCount();
+			batch_timer = esp_timer_get_time();
+			memcpy(file_batch, data, received);
+			batch_len = received;
+			batch_records = 1;
+		}
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+		if (buffer != NULL) vRingbufferReturnItem(from, (void *)buffer);
+#endif
+	} // end while
+
+	printf("Stop file logging\n");
+	logging_failed(NET_LOGGING_FILE);
+	vTaskDelete(NULL);
+}
+
+#if CONFIG_LOG_FILE_UPLOAD
+// POST one log file. Returns ESP_ERR_NOT_FOUND when the file no longer exists.
+static esp_err_t file_upload(esp_http_client_handle_t client, uint32_t number) {
+	char path[80];
+	file_path(path, sizeof(path), number);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return ESP_ERR_NOT_FOUND;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	esp_err_t ret = esp_http_client_open(client, size);
+	if (ret == ESP_OK) {
+		char buffer[512];
+		size_t len;
+		while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			if (esp_http_client_write(client, buffer, len) != len) {
+				ret = ESP_FAIL;
+				break;
+			}
+		}
+		if (ret == ESP_OK && esp_http_client_fetch_headers(client) < 0) ret = ESP_FAIL;
+		if (ret == ESP_OK) {
+			int status_code = esp_http_client_get_status_code(client);
+			if (status_code < 200 || status_code > 299) ret = ESP_FAIL;
+		}
+		esp_http_client_close(client);
+	}
+	fclose(file);
+	return ret;
+}
+
+// File Uploader Task
+// Closed log files are sent to CONFIG_LOG_FILE_UPLOAD_URL, oldest first, and removed once the server has them.
+// While the server can't be reached, files are only closed when they are full,
+// so that the logs written in the meantime are kept in as few files as possible.
+void file_uploader(void *pvParameters) {
+	esp_http_client_config_t config = {
+		.url = CONFIG_LOG_FILE_UPLOAD_URL,
+		.timeout_ms = 5000,
+	};
+	esp_http_client_handle_t client = esp_http_client_init(&config);
+	esp_http_client_set_method(client, HTTP_METHOD_POST);
+#if CONFIG_LOG_FILE_BINARY
+	esp_http_client_set_header(client, "Content-Type", "application/octet-stream");
+#else
+	esp_http_client_set_header(client, "Content-Type", "text/plain");
+#endif
+
+	bool online = true;
+	uint32_t number = file_first;
+	while(1) {
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_LOG_FILE_UPLOAD_INTERVAL * 1000));
+		// Have the logs written since the last upload sent next time.
+		// While offline, only when there is no closed file left to find out if the server is back.
+		if (online || number == file_current) file_rotate_request = true;
+
+		if ((int32_t)(number - file_first) < 0) number = file_first;
+		while (number != file_current) {
+			esp_err_t ret = file_upload(client, number);
+			online = (ret == ESP_OK || ret == ESP_ERR_NOT_FOUND);
+			if (!online) break;
+			// The file no longer counts against CONFIG_LOG_FILE_MAX_FILES
+			file_remove(number);
+			number++;
+		}
+	}
+}
+#endif
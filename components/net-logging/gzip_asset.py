@@ -0,0 +1,14 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Compress a web asset at build time.
+# mtime is fixed, so the output (and the ETag derived from it) only changes when the input does.
+
+import gzip
+import sys
+
+if __name__ == "__main__":
+	with open(sys.argv[1], "rb") as f:
+		data = f.read()
+	with open(sys.argv[2], "wb") as f:
+		f.write(gzip.compress(data, compresslevel=9, mtime=0))
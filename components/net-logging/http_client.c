@@ -19,23 +19,34 @@
 #endif
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
 #include "esp_http_client.h"
 
 #include "net_logging.h"
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-extern RingbufHandle_t xRingBufferHTTP;
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
+void *logging_receive_queued(int sink, size_t *received, RingbufHandle_t *from);
 #else
-extern MessageBufferHandle_t xMessageBufferHTTP;
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
+size_t logging_receive_queued(int sink, void *data, size_t size);
 #endif
 
-esp_err_t _http_event_handler(esp_http_client_event_t *evt)
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+void logging_stats_dropped(int sink, uint32_t records);
+void logging_ready(int sink, TaskHandle_t taskHandle);
+bool logging_retry(int sink, int *attempt);
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void));
+
+// The client of the task, also used by net_logging_flush() while the task is parked
+static esp_http_client_handle_t http_flush_client;
+
+// Logs are fire-and-forget, so the response body is discarded as it is read and only the status code is used.
+// The handler keeps no state of its own, so it is safe for any number of HTTP clients.
+static esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
-	static char *output_buffer;  // Buffer to store response of http request from event handler
-	static int output_len;		 // Stores number of bytes read
 	int mbedtls_err = 0;
-	esp_err_t err;
 	switch(evt->event_id) {
 		case HTTP_EVENT_ERROR:
 			//ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
@@ -51,69 +62,28 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 			break;
 		case HTTP_EVENT_ON_DATA:
 			//ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-			/*
-			 *	Check for chunked encoding is added as the URL for chunked encoding used in this example returns binary data.
-			 *	However, event handler can also be used in case chunked encoding is used.
-			 */
-			if (!esp_http_client_is_chunked_response(evt->client)) {
-				// If user_data buffer is configured, copy the response into the buffer
-				if (evt->user_data) {
-					memcpy(evt->user_data + output_len, evt->data, evt->data_len);
-				} else {
-					if (output_buffer == NULL) {
-						output_buffer = (char *) malloc(esp_http_client_get_content_length(evt->client));
-						output_len = 0;
-						if (output_buffer == NULL) {
-							//ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-							return ESP_FAIL;
-						}
-					}
-					memcpy(output_buffer + output_len, evt->data, evt->data_len);
-				}
-				output_len += evt->data_len;
-			}
-
+			// Response body is not needed
 			break;
 		case HTTP_EVENT_ON_FINISH:
 			//ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-			if (output_buffer != NULL) {
-				// Response is accumulated in output_buffer. Uncomment the below line to print the accumulated response
-				// ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-				free(output_buffer);
-				output_buffer = NULL;
-			}
-			output_len = 0;
 			break;
 		case HTTP_EVENT_DISCONNECTED:
 			//ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-			//int mbedtls_err = 0;
-			//esp_err_t err = esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
-			err = esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
-			if (err != 0) {
-				if (output_buffer != NULL) {
-					free(output_buffer);
-					output_buffer = NULL;
-				}
-				output_len = 0;
-				//ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
-				//ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
-			}
+			esp_tls_get_and_clear_last_error(evt->data, &mbedtls_err, NULL);
 			break;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
 		case HTTP_EVENT_REDIRECT:
 			//ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
 			break;
 #endif
+		default:
+			break;
 	}
 	return ESP_OK;
 }
 
-#define MAX_HTTP_OUTPUT_BUFFER 128
-
-static esp_err_t http_post_with_url(char *url, char * post_data, size_t post_len)
+static esp_http_client_handle_t http_client_create(char *url)
 {
-	//ESP_LOGI(TAG, "http_post_with_url url=[%s]", url);
-	char local_response_buffer[MAX_HTTP_OUTPUT_BUFFER] = {0};
 	/**
 	 * NOTE: All the configuration parameters for http_client must be spefied either in URL or as host and path parameters.
 	 * If host and path parameters are not set, query parameter will be ignored. In such cases,
@@ -121,50 +91,205 @@ static esp_err_t http_post_with_url(char *url, char * post_data, size_t post_len
 	 *
 	 * If URL as well as host and path parameters are specified, values of host and path will be considered.
 	 */
-
 	esp_http_client_config_t config = {
 		.url = url,
 		.path = "/post",
 		.event_handler = _http_event_handler,
-		.user_data = local_response_buffer, // Pass address of local buffer to get response
 		.disable_auto_redirect = true,
 	};
 
-#if 0
-	esp_http_client_config_t config = {
-		.url = "http://192.168.10.46:8000",
-		.path = "/post",
-		.event_handler = _http_event_handler,
-		.user_data = local_response_buffer, // Pass address of local buffer to get response
-		.disable_auto_redirect = true,
-	};
-#endif
-
-
+	// The client is created once per task and reused for every request,
+	// so the connection is kept alive when the server allows it.
 	esp_http_client_handle_t client = esp_http_client_init(&config);
-
-	// POST
+	if (client == NULL) return NULL;
 	esp_http_client_set_method(client, HTTP_METHOD_POST);
 	esp_http_client_set_header(client, "Content-Type", "application/json");
-	//esp_http_client_set_post_field(client, post_data, strlen(post_data));
+	return client;
+}
+
+static esp_err_t http_post(esp_http_client_handle_t client, char *post_data, size_t post_len)
+{
 	esp_http_client_set_post_field(client, post_data, post_len);
 	esp_err_t err = esp_http_client_perform(client);
 	//printf("esp_http_client_perform post_len=%d err=%d\n", post_len, err);
 	if (err == ESP_OK) {
-#if 0
-		ESP_LOGI(TAG, "HTTP POST Status = %d, content_length = %d",
-			esp_http_client_get_status_code(client),
-			esp_http_client_get_content_length(client));
-		ESP_LOGI(TAG, "local_response_buffer=[%s]", local_response_buffer);
-#endif
+		int status = esp_http_client_get_status_code(client);
+		if (status / 100 != 2) {
+			printf("HTTP POST Status = %d\n", status);
+			err = ESP_FAIL;
+		}
 	} else {
 		printf("HTTP POST request failed: %s\n", esp_err_to_name(err));
 	}
+	return err;
+}
 
-	esp_http_client_cleanup(client);
+#if CONFIG_LOG_HTTP_STREAM
+// Room for the chunk-size line ("3ff\r\n") in front of the batch
+#define HTTP_CHUNK_HEADER 8
+
+// Collect as many queued logs as fit into batch.
+// Wait up to xTicksToWait for the first one, then take only what is already queued.
+// Only the wait for the first one may park the task, so that a batch is never left behind by net_logging_flush().
+static size_t http_stream_collect(char *batch, size_t batch_size, TickType_t xTicksToWait, uint32_t *records)
+{
+	size_t batch_len = 0;
+	*records = 0;
+	while (batch_size - batch_len >= xItemSize) {
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+		size_t received;
+		RingbufHandle_t from;
+		char *buffer;
+		if (*records == 0) {
+			buffer = (char *)logging_receive(NET_LOGGING_HTTP, &received, xTicksToWait, &from);
+		} else {
+			buffer = (char *)logging_receive_queued(NET_LOGGING_HTTP, &received, &from);
+		}
+		if (buffer == NULL) break;
+		memcpy(batch + batch_len, buffer, received);
+		vRingbufferReturnItem(from, (void *)buffer);
+#else
+		size_t received;
+		if (*records == 0) {
+			received = logging_receive(NET_LOGGING_HTTP, batch + batch_len, batch_size - batch_len, xTicksToWait);
+		} else {
+			received = logging_receive_queued(NET_LOGGING_HTTP, batch + batch_len, batch_size - batch_len);
+		}
+		if (received == 0) break;
+#endif
+		batch_len += received;
+		(*records)++;
+	}
+	return batch_len;
+}
+
+// Finish the chunked request body and check the response status
+static esp_err_t http_stream_finish(esp_http_client_handle_t client)
+{
+	esp_err_t err = ESP_OK;
+	if (esp_http_client_write(client, "0\r\n\r\n", 5) != 5) {
+		err = ESP_FAIL;
+	} else {
+		esp_http_client_fetch_headers(client);
+		int status = esp_http_client_get_status_code(client);
+		if (status / 100 != 2) {
+			printf("HTTP stream request failed: status=%d\n", status);
+			err = ESP_FAIL;
+		}
+	}
+	esp_http_client_close(client);
 	return err;
 }
 
+// The open request, also finished by net_logging_flush() while the task is parked.
+// The logs written to it are sent only once the server has accepted it.
+static bool stream_opened;
+static size_t stream_len;
+static TickType_t stream_tick;
+static uint32_t stream_records;
+static int64_t stream_start;
+
+// Finish the open request and count its logs
+static void http_stream_close(esp_http_client_handle_t client)
+{
+	if (!stream_opened) return;
+	if (http_stream_finish(client) == ESP_OK) {
+		logging_stats_sent(NET_LOGGING_HTTP, stream_records, stream_len, stream_start);
+	} else {
+		printf("HTTP stream was not accepted, %"PRIu32" logs lost\n", stream_records);
+		logging_stats_dropped(NET_LOGGING_HTTP, stream_records);
+	}
+	stream_opened = false;
+}
+
+// Called by net_logging_flush() after the queued logs
+static void http_flush_finish(void)
+{
+	http_stream_close(http_flush_client);
+}
+
+// Send logs as the chunks of one long POST request.
+// The request is finished and reopened after LOG_HTTP_STREAM_MAX_SIZE bytes or LOG_HTTP_STREAM_MAX_AGE seconds.
+static void http_stream(esp_http_client_handle_t client, TaskHandle_t taskHandle)
+{
+	esp_http_client_set_header(client, "Content-Type", "text/plain");
+
+	const TickType_t max_age = pdMS_TO_TICKS(CONFIG_LOG_HTTP_STREAM_MAX_AGE * 1000);
+	char batch[HTTP_CHUNK_HEADER + xBufferSizeBytes + 2];
+
+	while (1) {
+		// Don't wait longer than the open request is allowed to live
+		TickType_t xTicksToWait = portMAX_DELAY;
+		if (stream_opened) {
+			TickType_t elapsed = xTaskGetTickCount() - stream_tick;
+			xTicksToWait = (elapsed < max_age) ? max_age - elapsed : 0;
+		}
+
+		char *data = batch + HTTP_CHUNK_HEADER;
+		uint32_t records;
+		size_t data_len = http_stream_collect(data, xBufferSizeBytes, xTicksToWait, &records);
+		if (data_len > 0) {
+			int64_t start = esp_timer_get_time();
+			if (!stream_opened) {
+				// Write length of -1 selects Transfer-Encoding: chunked.
+				// The batch is held until the server can be reached again.
+				int attempt = 0;
+				esp_err_t err;
+				while ((err = esp_http_client_open(client, -1)) != ESP_OK) {
+					printf("HTTP stream open failed: %s\n", esp_err_to_name(err));
+					if (!logging_retry(NET_LOGGING_HTTP, &attempt)) break;
+				}
+				if (err != ESP_OK) {
+					logging_stats_dropped(NET_LOGGING_HTTP, records);
+					continue;
+				}
+				logging_ready(NET_LOGGING_HTTP, taskHandle);
+				stream_opened = true;
+				stream_tick = xTaskGetTickCount();
+				stream_len = 0;
+				stream_records = 0;
+				stream_start = start;
+			}
+
+			// Put the chunk-size line right in front of the data, so a chunk is a single write
+			char size_line[HTTP_CHUNK_HEADER + 1];
+			int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", data_len);
+			char *chunk = data - size_len;
+			memcpy(chunk, size_line, size_len);
+			memcpy(data + data_len, "\r\n", 2);
+			int chunk_len = size_len + data_len + 2;
+			if (esp_http_client_write(client, chunk, chunk_len) != chunk_len) {
+				printf("HTTP stream write failed, %"PRIu32" logs lost\n", stream_records + records);
+				logging_stats_dropped(NET_LOGGING_HTTP, stream_records + records);
+				esp_http_client_close(client);
+				stream_opened = false;
+				continue;
+			}
+			stream_len += data_len;
+			stream_records += records;
+		}
+
+		if (stream_opened) {
+			if (stream_len >= CONFIG_LOG_HTTP_STREAM_MAX_SIZE || xTaskGetTickCount() - stream_tick >= max_age) {
+				http_stream_close(client);
+			}
+		}
+	}
+}
+#endif
+
+// Called by net_logging_flush() for each queued log, with a POST of its own.
+// With LOG_HTTP_STREAM, the open request is finished first, so the logs stay in order.
+static bool http_flush_send(const void *data, size_t len)
+{
+#if CONFIG_LOG_HTTP_STREAM
+	http_stream_close(http_flush_client);
+#endif
+	// Remove trailing LF
+	if (len > 0 && ((const char *)data)[len-1] == 0x0a) len = len - 1;
+	if (len == 0) return true;
+	return http_post(http_flush_client, (char *)data, len) == ESP_OK;
+}
 
 void http_client(void *pvParameters)
 {
@@ -173,33 +298,63 @@ void http_client(void *pvParameters)
 	memcpy((char *)&param, task_parameter, sizeof(PARAMETER_t));
 	printf("Start:param.url=[%s]\n", param.url);
 
+	esp_http_client_handle_t client = http_client_create(param.url);
+	if (client == NULL) vTaskDelete(NULL);
+	http_flush_client = client;
+#if CONFIG_LOG_HTTP_STREAM
+	logging_flusher(NET_LOGGING_HTTP, http_flush_send, http_flush_finish);
+#else
+	logging_flusher(NET_LOGGING_HTTP, http_flush_send, NULL);
+#endif
+
+#if !CONFIG_NET_LOGGING_ASYNC_START
 	// Try to connect to http server
-	esp_err_t err = http_post_with_url(param.url, "", 0);
-	printf("http_post_with_url err=%d\n", err);
-	if (err != ESP_OK) vTaskDelete(NULL);
-	
-	// Send ready to receive notify
-	xTaskNotifyGive(param.taskHandle);
+	esp_err_t err = http_post(client, "", 0);
+	printf("http_post err=%d\n", err);
+	if (err != ESP_OK) {
+		esp_http_client_cleanup(client);
+		vTaskDelete(NULL);
+	}
+	logging_ready(NET_LOGGING_HTTP, param.taskHandle);
+#endif
+
+#if CONFIG_LOG_HTTP_STREAM
+	http_stream(client, param.taskHandle);
+#endif
 
 	while (1) {
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 		size_t received;
-		char *buffer = (char *)xRingbufferReceive(xRingBufferHTTP, &received, portMAX_DELAY);
+		RingbufHandle_t from;
+		char *buffer = (char *)logging_receive(NET_LOGGING_HTTP, &received, portMAX_DELAY, &from);
 		//printf("xRingBufferReceive received=%d\n", received);
 #else
 		char buffer[xItemSize];
-		size_t received = xMessageBufferReceive(xMessageBufferHTTP, buffer, sizeof(buffer), portMAX_DELAY);
+		size_t received = logging_receive(NET_LOGGING_HTTP, buffer, sizeof(buffer), portMAX_DELAY);
 		//printf("xMessageBufferReceive received=%d\n", received);
 #endif
 		if (received > 0) {
 			//printf("xMessageBufferReceive buffer=[%.*s]\n",received, buffer);
+			int64_t start = esp_timer_get_time();
 			// Remove trailing LF
 			if (buffer[received-1] == 0x0a) received = received - 1;
 			if (received) {
-				http_post_with_url(param.url, buffer, received);
+				// The same log is posted again while the server can't be reached.
+				// ESP_FAIL is an answer from the server, that log is not tried again.
+				int attempt = 0;
+				esp_err_t err;
+				while ((err = http_post(client, buffer, received)) != ESP_OK && err != ESP_FAIL) {
+					if (!logging_retry(NET_LOGGING_HTTP, &attempt)) break;
+				}
+				if (err == ESP_OK) {
+					logging_ready(NET_LOGGING_HTTP, param.taskHandle);
+					logging_stats_sent(NET_LOGGING_HTTP, 1, received, start);
+				} else {
+					logging_stats_dropped(NET_LOGGING_HTTP, 1);
+				}
 			}
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-			vRingbufferReturnItem(xRingBufferHTTP, (void *)buffer);
+			vRingbufferReturnItem(from, (void *)buffer);
 #endif
 		} else {
 			printf("xMessageBufferReceive fail\n");
@@ -208,5 +363,6 @@ void http_client(void *pvParameters)
 	} // end while
 
 	// Stop connection
+	esp_http_client_cleanup(client);
 	vTaskDelete(NULL);
 }
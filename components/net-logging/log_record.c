@@ -0,0 +1,371 @@
+/*
+	Binary log record
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "log_record.h"
+
+// Longest tag that is kept, so that the header stays small
+#define LOG_RECORD_TAG_MAX 32
+
+// Tags are looked up by their pointer, like the tag cache of esp_log does, so they must not move.
+// The table is never more than half full.
+#define LOG_RECORD_SLOTS (LOG_RECORD_TAGS * 2)
+typedef struct {
+	const char *tag;
+	uint32_t id;
+} LOG_RECORD_SLOT_t;
+
+static LOG_RECORD_SLOT_t log_record_slots[LOG_RECORD_SLOTS];
+static const char *log_record_names[LOG_RECORD_TAGS]; // by ID
+static uint32_t log_record_count; // IDs given out
+static portMUX_TYPE log_record_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// The clock is taken as set from 2020 on
+#define LOG_RECORD_TIME_VALID 1577836800
+
+// UTC in microseconds when esp_timer was 0, and a number that changes with it, 0 until the time is known
+static int64_t log_record_boot_utc;
+static uint32_t log_record_time_version;
+
+static size_t log_record_varint(uint8_t *p, uint64_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		p[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[len++] = value;
+	return len;
+}
+
+// Returns the byte after the varint, NULL when it goes past end
+static const uint8_t *log_record_read(const uint8_t *p, const uint8_t *end, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t byte = *p++;
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if (byte < 0x80) return p;
+	}
+	return NULL;
+}
+
+// Returns the ID of a tag, 0 when all IDs have been given out
+static uint32_t log_record_intern(const char *tag) {
+	uint32_t hash = (uint32_t)((uintptr_t)tag >> 2) * 2654435761u;
+	uint32_t i = (hash >> 16) % LOG_RECORD_SLOTS;
+	uint32_t id = 0;
+	portENTER_CRITICAL_SAFE(&log_record_lock);
+	while (log_record_slots[i].tag != NULL && log_record_slots[i].tag != tag) {
+		i = (i + 1) % LOG_RECORD_SLOTS;
+	}
+	if (log_record_slots[i].tag == tag) {
+		id = log_record_slots[i].id;
+	} else if (log_record_count < LOG_RECORD_TAGS - 1) {
+		id = ++log_record_count;
+		log_record_names[id] = tag;
+		log_record_slots[i].id = id;
+		log_record_slots[i].tag = tag;
+	}
+	portEXIT_CRITICAL_SAFE(&log_record_lock);
+	return id;
+}
+
+// ESP_LOGx() uses a format made by LOG_FORMAT(): [color] letter " (%" PRIu32 ") %s: " format [reset color] "\n",
+// or by LOG_SYSTEM_TIME_FORMAT(), which has "%s" for the time. The timestamp and the tag are the first arguments.
+// Returns the format of the message, or NULL when fmt was not made this way.
+static const char *log_record_prefix(const char *fmt, uint8_t *level, bool *time_string) {
+	if (fmt[0] == '\033') {
+		fmt = strchr(fmt, 'm');
+		if (fmt == NULL) return NULL;
+		fmt++;
+	}
+	static const char letters[] = "EWIDV";
+	const char *letter = strchr(letters, fmt[0]);
+	if (fmt[0] == 0 || letter == NULL) return NULL;
+	if (strncmp(&fmt[1], " (%", 3) != 0) return NULL;
+	const char *end = strstr(&fmt[4], ") %s: ");
+	if (end == NULL || end - &fmt[4] > 4) return NULL;
+	*level = letter - letters + 1; // ESP_LOG_ERROR ... ESP_LOG_VERBOSE
+	*time_string = (end[-1] == 's');
+	return end + 6;
+}
+
+// The level and tag of a log made by ESP_LOGx(), without formatting it.
+// Returns NULL and leaves level 0 when fmt was not made by LOG_FORMAT().
+const char *log_record_tag(const char *fmt, va_list l, uint8_t *level) {
+	bool time_string;
+	*level = 0;
+	if (log_record_prefix(fmt, level, &time_string) == NULL) return NULL;
+	va_list ap;
+	va_copy(ap, l);
+	if (time_string) {
+		(void)va_arg(ap, const char *);
+	} else {
+		(void)va_arg(ap, uint32_t);
+	}
+	const char *tag = va_arg(ap, const char *);
+	va_end(ap);
+	return tag;
+}
+
+// Remove the color codes and the newline around a message. Returns the new length.
+static size_t log_record_message(uint8_t *message, size_t len) {
+	if (len > 0 && message[0] == '\033') {
+		uint8_t *m = memchr(message, 'm', len);
+		size_t skip = (m != NULL) ? m - message + 1 : len;
+		memmove(message, message + skip, len - skip);
+		len -= skip;
+	}
+	while (len > 0) {
+		if (message[len - 1] == '\n' || message[len - 1] == '\r') {
+			len--;
+			continue;
+		}
+		// The reset color, which may have been cut short by the size of the record
+		size_t i;
+		for (i = 1; i <= 4 && i <= len; i++) {
+			if (message[len - i] == '\033') break;
+		}
+		if (i > 4 || i > len) break;
+		len -= i;
+	}
+	return len;
+}
+
+// Everything before the message. Room for a 2 byte length is left in front.
+static size_t log_record_header(uint8_t *record, int64_t timestamp, uint8_t level, const char *tag, const char *task) {
+	uint8_t *p = record + 2;
+	*p++ = LOG_RECORD_LOG;
+	p += log_record_varint(p, timestamp);
+	*p++ = level;
+	*p++ = xPortGetCoreID();
+	uint32_t id = (tag[0] != 0) ? log_record_intern(tag) : 0;
+	p += log_record_varint(p, id);
+	if (id == 0) {
+		size_t tag_len = strnlen(tag, LOG_RECORD_TAG_MAX);
+		*p++ = tag_len;
+		memcpy(p, tag, tag_len);
+		p += tag_len;
+	}
+	size_t task_len = strnlen(task, configMAX_TASK_NAME_LEN);
+	*p++ = task_len;
+	memcpy(p, task, task_len);
+	p += task_len;
+	return p - record;
+}
+
+// Put the length in front of the record. Returns the length of the whole record.
+static size_t log_record_finish(uint8_t *record, size_t len) {
+	size_t body = len - 2;
+	if (body < 0x80) {
+		memmove(record + 1, record + 2, body);
+		record[0] = body;
+		return body + 1;
+	}
+	record[0] = (body & 0x7f) | 0x80;
+	record[1] = body >> 7;
+	return len;
+}
+
+// Encode the arguments of logging_vprintf() as a record, timestamp is esp_timer_get_time() when it was called.
+// size must be at least xItemSize. Returns the length of the record, 0 on a format error.
+size_t log_record_encode(uint8_t *record, size_t size, int64_t timestamp, const char *fmt, va_list l) {
+	uint8_t level = 0;
+	bool time_string = false;
+	const char *tag = "";
+	va_list ap;
+	// Leave l for the text
+	va_copy(ap, l);
+	const char *format = log_record_prefix(fmt, &level, &time_string);
+	if (format != NULL) {
+		if (time_string) {
+			(void)va_arg(ap, const char *);
+		} else {
+			(void)va_arg(ap, uint32_t);
+		}
+		tag = va_arg(ap, const char *);
+	} else {
+		// Not from ESP_LOGx(), e.g. the second half of a wifi log
+		format = fmt;
+	}
+
+	size_t len = log_record_header(record, timestamp, level, tag, pcTaskGetName(NULL));
+	// The terminating null is not part of the record
+	int message_len = vsnprintf((char *)&record[len], size - len, format, ap);
+	va_end(ap);
+	if (message_len < 0) return 0;
+	if (message_len > size - len - 1) message_len = size - len - 1;
+	len += log_record_message(&record[len], message_len);
+	return log_record_finish(record, len);
+}
+
+// Encode a line of text, like the logs of the crash tail, as a record without level and tag
+size_t log_record_encode_text(uint8_t *record, size_t size, const char *text) {
+	size_t len = log_record_header(record, esp_timer_get_time(), 0, "", "");
+	size_t message_len = strnlen(text, size - len);
+	memcpy(&record[len], text, message_len);
+	len += log_record_message(&record[len], message_len);
+	return log_record_finish(record, len);
+}
+
+// Turn a LOG_RECORD_LOG record back into a line like "I (1234) TAG: message\n", the time in milliseconds.
+// tag is used when the record has a tag ID, as its definition may be gone. Returns the length of the line, 0 if it is not a log.
+size_t log_record_text(char *text, size_t size, const uint8_t *record, size_t len, const char *tag) {
+	static const char letters[] = "?EWIDV";
+	const uint8_t *end = record + len;
+	uint64_t value;
+	uint64_t timestamp;
+	const uint8_t *p = log_record_read(record, end, &value); // length
+	if (p == NULL || p == end || *p++ != LOG_RECORD_LOG) return 0;
+	p = log_record_read(p, end, &timestamp);
+	if (p == NULL || end - p < 2) return 0;
+	uint8_t level = *p;
+	p += 2; // level and core
+	p = log_record_read(p, end, &value); // tag ID
+	if (p == NULL) return 0;
+	int tag_len = strlen(tag);
+	if (value == 0) {
+		if (p == end || end - p - 1 < *p) return 0;
+		tag_len = *p++;
+		tag = (const char *)p;
+		p += tag_len;
+	}
+	if (p == end || end - p - 1 < *p) return 0;
+	p += *p + 1; // task name
+	int message_len = end - p;
+
+	int text_len;
+	if (level == 0 || level >= sizeof(letters) - 1) {
+		text_len = snprintf(text, size, "%.*s\n", message_len, (const char *)p);
+	} else {
+		text_len = snprintf(text, size, "%c (%lu) %.*s: %.*s\n", letters[level], (unsigned long)(timestamp / 1000),
+			tag_len, tag, message_len, (const char *)p);
+	}
+	if (text_len < 0) return 0;
+	return (text_len < size) ? text_len : size - 1;
+}
+
+// The record that defines a tag ID. Returns 0 for an ID that has not been given out.
+size_t log_record_define(uint8_t *record, size_t size, uint32_t id) {
+	const char *tag = NULL;
+	portENTER_CRITICAL_SAFE(&log_record_lock);
+	if (id > 0 && id <= log_record_count) tag = log_record_names[id];
+	portEXIT_CRITICAL_SAFE(&log_record_lock);
+	if (tag == NULL) return 0;
+
+	uint8_t *p = record + 2;
+	*p++ = LOG_RECORD_TAG;
+	p += log_record_varint(p, id);
+	size_t tag_len = strnlen(tag, LOG_RECORD_TAG_MAX);
+	memcpy(p, tag, tag_len);
+	p += tag_len;
+	return log_record_finish(record, p - record);
+}
+
+// The tag ID of a LOG_RECORD_LOG record, 0 when it has none
+static uint32_t log_record_tag_id(const uint8_t *record, size_t len) {
+	const uint8_t *end = record + len;
+	uint64_t value;
+	const uint8_t *p = log_record_read(record, end, &value); // length
+	if (p == NULL || p == end || *p++ != LOG_RECORD_LOG) return 0;
+	p = log_record_read(p, end, &value); // timestamp
+	if (p == NULL || end - p < 2) return 0;
+	p += 2; // level and core
+	p = log_record_read(p, end, &value);
+	return (p != NULL) ? value : 0;
+}
+
+// Take the difference between esp_timer and UTC, once the clock has been set by SNTP.
+// Called again when SNTP corrects the clock.
+void log_record_time_sync(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec < LOG_RECORD_TIME_VALID) return;
+	int64_t boot_utc = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time();
+	portENTER_CRITICAL_SAFE(&log_record_lock);
+	log_record_boot_utc = boot_utc;
+	log_record_time_version++;
+	portEXIT_CRITICAL_SAFE(&log_record_lock);
+}
+
+// The LOG_RECORD_TIME record with the current difference. Returns 0 while the time is not known.
+size_t log_record_time(uint8_t *record, size_t size, uint32_t *version) {
+	portENTER_CRITICAL_SAFE(&log_record_lock);
+	int64_t boot_utc = log_record_boot_utc;
+	*version = log_record_time_version;
+	portEXIT_CRITICAL_SAFE(&log_record_lock);
+	if (*version == 0) return 0;
+
+	uint8_t *p = record + 2;
+	*p++ = LOG_RECORD_TIME;
+	p += log_record_varint(p, boot_utc);
+	return log_record_finish(record, p - record);
+}
+
+// Called by each sink with the time after which the definitions are sent again,
+// for receivers that start listening later, like UDP and MQTT.
+void log_record_tags_init(LOG_RECORD_TAGS_t *tags, TickType_t interval) {
+	memset(tags, 0, sizeof(*tags));
+	tags->interval = interval;
+	tags->time_check = xTaskGetTickCount() - pdMS_TO_TICKS(1000);
+	log_record_tags_reset(tags);
+}
+
+// Forget the definitions sent, e.g. on a new connection
+void log_record_tags_reset(LOG_RECORD_TAGS_t *tags) {
+	memset(tags->sent, 0, sizeof(tags->sent));
+	tags->time_version = 0;
+	tags->start = xTaskGetTickCount();
+}
+
+// Called before a record is sent. When the receiver doesn't know the time or the tag ID yet,
+// returns the length of the definitions to send first and counts them as sent, otherwise 0.
+// size must be at least LOG_RECORD_DEFINE_SIZE.
+size_t log_record_tags_check(LOG_RECORD_TAGS_t *tags, const uint8_t *record, size_t len, uint8_t *definition, size_t size) {
+	TickType_t now = xTaskGetTickCount();
+	if (tags->interval != 0 && now - tags->start >= tags->interval) {
+		log_record_tags_reset(tags);
+	}
+
+	// For applications that don't call net_logging_time_sync(), see once a second if the clock has been set
+	if (log_record_time_version == 0 && now - tags->time_check >= pdMS_TO_TICKS(1000)) {
+		tags->time_check = now;
+		log_record_time_sync();
+	}
+	size_t definition_len = 0;
+	if (log_record_time_version != tags->time_version) {
+		uint32_t version;
+		definition_len = log_record_time(definition, size, &version);
+		tags->time_version = version;
+	}
+
+	uint32_t id = log_record_tag_id(record, len);
+	if (id == 0 || id >= LOG_RECORD_TAGS) return definition_len;
+	uint32_t bit = 1u << (id % 32);
+	if (tags->sent[id / 32] & bit) return definition_len;
+	size_t tag_len = log_record_define(&definition[definition_len], size - definition_len, id);
+	if (tag_len > 0) tags->sent[id / 32] |= bit;
+	return definition_len + tag_len;
+}
+
+// The next tag ID after id whose definition has been sent, 0 when there are no more
+uint32_t log_record_tags_next(LOG_RECORD_TAGS_t *tags, uint32_t id) {
+	for (id++; id < LOG_RECORD_TAGS; id++) {
+		if (tags->sent[id / 32] & (1u << (id % 32))) return id;
+	}
+	return 0;
+}
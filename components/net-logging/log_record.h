@@ -0,0 +1,71 @@
+#ifndef LOG_RECORD_H_
+#define LOG_RECORD_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+// Binary log record, used by the sinks that are set to send binary records.
+//
+// varint  length of the rest of the record
+// uint8   type, LOG_RECORD_LOG
+// varint  timestamp, microseconds of esp_timer when the log was made
+// uint8   level, esp_log_level_t: 1=E 2=W 3=I 4=D 5=V, 0 when the log has no ESP prefix
+// uint8   core
+// varint  tag ID, 0 when the tag follows as a string
+// uint8   length of the tag, then the tag, only when the tag ID is 0
+// uint8   length of the task name, then the task name
+//         the message, up to the end of the record, without color codes and newline
+//
+// A tag ID is defined by a LOG_RECORD_TAG record before the first record that uses it.
+// IDs are given out from 1 as tags are first seen, and are valid until the ESP32 restarts.
+//
+// varint  length of the rest of the record
+// uint8   type, LOG_RECORD_TAG
+// varint  tag ID
+//         the tag, up to the end of the record
+//
+// A LOG_RECORD_TIME record tells how to turn the timestamps into UTC.
+// It is sent once the clock has been set by SNTP, and again when SNTP corrects it.
+// The timestamps of all records from then on are converted with it.
+//
+// varint  length of the rest of the record
+// uint8   type, LOG_RECORD_TIME
+// varint  UTC in microseconds since 1970 when esp_timer was 0
+//
+// A varint is 7 bits per byte, least significant first, the top bit set on all bytes but the last.
+// log_record.py decodes the records.
+#define LOG_RECORD_LOG 1
+#define LOG_RECORD_TAG 2
+#define LOG_RECORD_TIME 3
+
+// Number of tags that get an ID, later tags are sent as strings
+#define LOG_RECORD_TAGS 128
+
+// Room for a LOG_RECORD_TIME and a LOG_RECORD_TAG record
+#define LOG_RECORD_DEFINE_SIZE 64
+
+// The tag IDs and the time a receiver has been sent the definition of
+typedef struct {
+	uint32_t sent[LOG_RECORD_TAGS / 32];
+	uint32_t time_version;
+	TickType_t time_check;
+	TickType_t start;
+	TickType_t interval; // send the definitions again after this, 0 for never
+} LOG_RECORD_TAGS_t;
+
+size_t log_record_encode(uint8_t *record, size_t size, int64_t timestamp, const char *fmt, va_list l);
+size_t log_record_encode_text(uint8_t *record, size_t size, const char *text);
+size_t log_record_text(char *text, size_t size, const uint8_t *record, size_t len, const char *tag);
+size_t log_record_define(uint8_t *record, size_t size, uint32_t id);
+size_t log_record_time(uint8_t *record, size_t size, uint32_t *version);
+const char *log_record_tag(const char *fmt, va_list l, uint8_t *level);
+void log_record_time_sync(void);
+
+void log_record_tags_init(LOG_RECORD_TAGS_t *tags, TickType_t interval);
+void log_record_tags_reset(LOG_RECORD_TAGS_t *tags);
+size_t log_record_tags_check(LOG_RECORD_TAGS_t *tags, const uint8_t *record, size_t len, uint8_t *definition, size_t size);
+uint32_t log_record_tags_next(LOG_RECORD_TAGS_t *tags, uint32_t id);
+
+#endif /* LOG_RECORD_H_ */
@@ -0,0 +1,155 @@
+/*
+	Logging duplicate suppression
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "net_logging.h"
+
+#if CONFIG_NET_LOGGING_DEDUP
+
+// The last log of each tag, by the address of the tag, like the levels of logging_filter.c.
+// Once they are all taken, the logs of the other tags are sent as they are.
+#define DEDUP_SLOTS 32
+#define DEDUP_PROBES 8
+
+typedef struct {
+	const char *tag;
+	uint32_t hash;     // of the log without the time
+	uint8_t level;
+	uint32_t repeats;  // since the log was last sent or reported
+	int64_t since;     // esp_timer_get_time() of the first of those repeats
+} DEDUP_SLOT_t;
+
+static DEDUP_SLOT_t dedup_slots[DEDUP_SLOTS];
+static portMUX_TYPE dedup_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Runs only while there are repeats held back, see dedup_arm()
+static esp_timer_handle_t dedup_timer;
+static atomic_bool dedup_armed;
+
+void logging_note(const char *tag, uint8_t level, const char *message);
+
+static void dedup_report(const char *tag, uint8_t level, uint32_t repeats) {
+	char message[40];
+	snprintf(message, sizeof(message), "last message repeated %"PRIu32" times", repeats);
+	logging_note(tag, level, message);
+}
+
+// FNV-1a of the log after the time, "I (1234) tag: message" is hashed from "tag: message"
+static uint32_t dedup_hash(const char *text) {
+	const char *p = strstr(text, ") ");
+	p = (p != NULL) ? p + 2 : text;
+	uint32_t hash = 2166136261u;
+	while (*p) {
+		hash ^= (uint8_t)*p++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static DEDUP_SLOT_t *dedup_slot(const char *tag) {
+	uint32_t hash = ((uintptr_t)tag >> 2) * 2654435761u;
+	for (int probe = 0; probe < DEDUP_PROBES; probe++) {
+		DEDUP_SLOT_t *slot = &dedup_slots[(hash + probe) % DEDUP_SLOTS];
+		if (slot->tag == tag) return slot;
+		if (slot->tag == NULL) {
+			slot->tag = tag;
+			slot->hash = 0;
+			slot->repeats = 0;
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+// Start the timer for repeats that are due in delay microseconds, unless it runs already
+static void dedup_arm(int64_t delay) {
+	if (dedup_timer == NULL || atomic_exchange(&dedup_armed, true)) return;
+	if (esp_timer_start_once(dedup_timer, delay) != ESP_OK) atomic_store(&dedup_armed, false);
+}
+
+// Called by logging_vprintf() with the formatted log.
+// Returns true when it is the same as the last log of its tag, which is then only counted.
+// When the tag logs something else, the repeats of the last log are reported first.
+bool logging_dedup(const char *tag, uint8_t level, const char *text) {
+	if (tag == NULL) return false;
+	uint32_t hash = dedup_hash(text);
+	uint32_t repeats = 0;
+	uint8_t repeated_level = 0;
+	taskENTER_CRITICAL(&dedup_lock);
+	DEDUP_SLOT_t *slot = dedup_slot(tag);
+	if (slot != NULL) {
+		if (slot->hash == hash && slot->level == level) {
+			bool first = (slot->repeats++ == 0);
+			if (first) slot->since = esp_timer_get_time();
+			taskEXIT_CRITICAL(&dedup_lock);
+			if (first) dedup_arm(CONFIG_NET_LOGGING_DEDUP_TIMEOUT * 1000000LL);
+			return true;
+		}
+		repeats = slot->repeats;
+		repeated_level = slot->level;
+		slot->hash = hash;
+		slot->level = level;
+		slot->repeats = 0;
+	}
+	taskEXIT_CRITICAL(&dedup_lock);
+	if (repeats > 0) dedup_report(tag, repeated_level, repeats);
+	return false;
+}
+
+// Runs in the esp_timer task when the oldest repeats are due, and reports the repeats held back for too long.
+// The log stays the last of its tag, so its next repeats are counted again from 0.
+static void dedup_timeout(void *arg) {
+	// A repeat counted from now on starts the timer again
+	atomic_store(&dedup_armed, false);
+	int64_t now = esp_timer_get_time();
+	int64_t next = INT64_MAX;
+	for (int i = 0; i < DEDUP_SLOTS; i++) {
+		DEDUP_SLOT_t *slot = &dedup_slots[i];
+		taskENTER_CRITICAL(&dedup_lock);
+		const char *tag = slot->tag;
+		uint8_t level = slot->level;
+		uint32_t repeats = 0;
+		if (slot->repeats > 0) {
+			int64_t due = slot->since + CONFIG_NET_LOGGING_DEDUP_TIMEOUT * 1000000LL;
+			if (due <= now) {
+				repeats = slot->repeats;
+				slot->repeats = 0;
+			} else if (due < next) {
+				next = due;
+			}
+		}
+		taskEXIT_CRITICAL(&dedup_lock);
+		if (repeats > 0) dedup_report(tag, level, repeats);
+	}
+	// The timer stops when nothing is held back
+	if (next != INT64_MAX) dedup_arm(next - now);
+}
+
+// Done once, by the first *_logging_init()
+void logging_dedup_start(void) {
+	esp_timer_create_args_t args = {
+		.callback = dedup_timeout,
+		.name = "net_logging_dedup",
+	};
+	if (esp_timer_create(&args, &dedup_timer) != ESP_OK) {
+		dedup_timer = NULL;
+		printf("repeated logs are reported only when their tag logs something else\n");
+	}
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+	Logging filters, by sink and tag
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "net_logging.h"
+
+// Sinks and stdout, NET_LOGGING_UDP ... NET_LOGGING_STDOUT
+#define FILTER_TARGETS (NET_LOGGING_STDOUT + 1)
+#define FILTER_ALL ((1 << FILTER_TARGETS) - 1)
+
+// Rules for single tags or tag prefixes, the default of each target is kept apart
+#define FILTER_RULES 16
+// Tags of up to 31 characters, about as long as the binary records keep (LOG_RECORD_TAG_MAX)
+#define FILTER_TAG_SIZE 32
+
+// The levels of a tag for all targets, 4 bits each, cached by the address of the tag.
+// Tags are string literals, so the same tag comes with the same address, like the tag cache of esp_log.
+#define FILTER_SLOTS 64
+#define FILTER_PROBES 8
+
+typedef struct {
+	char tag[FILTER_TAG_SIZE]; // without the trailing '*' of a prefix
+	uint8_t len;
+	bool prefix;
+	uint8_t target;
+	uint8_t level;
+} FILTER_RULE_t;
+
+typedef struct {
+	const char *tag;
+	uint32_t generation;
+	uint32_t levels;
+} FILTER_SLOT_t;
+
+static FILTER_RULE_t filter_rules[FILTER_RULES];
+static int filter_rules_len;
+static uint8_t filter_default[FILTER_TARGETS] = { [0 ... FILTER_TARGETS - 1] = ESP_LOG_VERBOSE };
+static FILTER_SLOT_t filter_slots[FILTER_SLOTS];
+// Slots of an older generation are out of date, slots that were never used have 0
+static uint32_t filter_generation = 1;
+// Nothing is filtered until net_logging_level_set() is called
+static volatile bool filter_active = false;
+static portMUX_TYPE filter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// The level of a tag for one target: the rule for the tag, else the rule for the longest prefix, else the default
+static uint8_t filter_level(const char *tag, int target) {
+	int best = -1;
+	for (int i = 0; i < filter_rules_len; i++) {
+		FILTER_RULE_t *rule = &filter_rules[i];
+		if (rule->target != target) continue;
+		if (rule->prefix) {
+			if (strncmp(tag, rule->tag, rule->len) != 0) continue;
+			if (best >= 0 && (!filter_rules[best].prefix || filter_rules[best].len >= rule->len)) continue;
+		} else {
+			if (strcmp(tag, rule->tag) != 0) continue;
+		}
+		best = i;
+	}
+	return (best >= 0) ? filter_rules[best].level : filter_default[target];
+}
+
+static uint32_t filter_levels(const char *tag) {
+	uint32_t levels = 0;
+	for (int target = 0; target < FILTER_TARGETS; target++) {
+		uint8_t level = (tag != NULL) ? filter_level(tag, target) : filter_default[target];
+		levels |= (uint32_t)level << (target * 4);
+	}
+	return levels;
+}
+
+// Called by logging_vprintf() before the log is formatted.
+// Returns the targets that want a log of this tag and level, as bits 1 << NET_LOGGING_UDP ...
+// tag is NULL and level 0 for a log not made by ESP_LOGx(), which is filtered like INFO by the defaults.
+uint32_t logging_filter(const char *tag, uint8_t level) {
+	if (!filter_active) return FILTER_ALL;
+	if (level == 0) level = ESP_LOG_INFO;
+
+	uint32_t levels = 0;
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	if (tag == NULL) {
+		levels = filter_levels(NULL);
+	} else {
+		uint32_t hash = ((uintptr_t)tag >> 2) * 2654435761u;
+		FILTER_SLOT_t *slot = NULL;
+		for (int probe = 0; probe < FILTER_PROBES; probe++) {
+			FILTER_SLOT_t *s = &filter_slots[(hash + probe) % FILTER_SLOTS];
+			if (s->generation == filter_generation && s->tag == tag) {
+				slot = s;
+				break;
+			}
+			// The first free or out of date slot takes the tag, else the first slot is replaced
+			if (slot == NULL && s->generation != filter_generation) slot = s;
+		}
+		if (slot == NULL) slot = &filter_slots[hash % FILTER_SLOTS];
+		if (slot->generation != filter_generation || slot->tag != tag) {
+			slot->tag = tag;
+			slot->levels = filter_levels(tag);
+			slot->generation = filter_generation;
+		}
+		levels = slot->levels;
+	}
+	portEXIT_CRITICAL_SAFE(&filter_lock);
+
+	uint32_t targets = 0;
+	for (int target = 0; target < FILTER_TARGETS; target++) {
+		if (((levels >> (target * 4)) & 0xf) >= level) targets |= 1 << target;
+	}
+	return targets;
+}
+
+// Send the logs of tag to target up to level, like esp_log_level_set() does for all.
+// tag "*" sets the level of the tags without a rule, a tag ending with '*' is a prefix, like "app_*".
+// esp_log_level_set() still comes first, a log it stops reaches no sink.
+esp_err_t net_logging_level_set(int target, const char *tag, esp_log_level_t level) {
+	if (target < 0 || target >= FILTER_TARGETS || tag == NULL) return ESP_ERR_INVALID_ARG;
+	if (level > ESP_LOG_VERBOSE) level = ESP_LOG_VERBOSE;
+	size_t len = strlen(tag);
+	bool prefix = (len > 0 && tag[len - 1] == '*');
+	if (prefix) len--;
+	if (len >= FILTER_TAG_SIZE) return ESP_ERR_INVALID_ARG;
+
+	esp_err_t ret = ESP_OK;
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	if (prefix && len == 0) {
+		filter_default[target] = level;
+	} else {
+		FILTER_RULE_t *rule = NULL;
+		for (int i = 0; i < filter_rules_len; i++) {
+			FILTER_RULE_t *r = &filter_rules[i];
+			if (r->target == target && r->prefix == prefix && r->len == len && strncmp(r->tag, tag, len) == 0) rule = r;
+		}
+		if (rule == NULL && filter_rules_len < FILTER_RULES) {
+			rule = &filter_rules[filter_rules_len++];
+			memcpy(rule->tag, tag, len);
+			rule->tag[len] = 0;
+			rule->len = len;
+			rule->prefix = prefix;
+			rule->target = target;
+		}
+		if (rule != NULL) {
+			rule->level = level;
+		} else {
+			ret = ESP_ERR_NO_MEM;
+		}
+	}
+	// The cached levels are worked out again
+	filter_generation++;
+	filter_active = true;
+	portEXIT_CRITICAL_SAFE(&filter_lock);
+	return ret;
+}
@@ -0,0 +1,255 @@
+/*
+	Logging rate limits, by tag and sink
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "net_logging.h"
+
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+
+// One log, in the units of the buckets. Counting in millionths makes the refill a plain multiplication.
+#define LIMIT_TOKEN 1000000LL
+
+// Tags with a rate of their own
+#define LIMIT_RULES 8
+#define LIMIT_TAG_SIZE 16
+
+// Buckets by the address of the tag, like the levels of logging_filter.c.
+// Once they are all taken, the other tags share the last one.
+#define LIMIT_SLOTS 64
+#define LIMIT_PROBES 8
+
+typedef struct {
+	int64_t tokens; // LIMIT_TOKEN for each log that may be sent now
+	int64_t last;   // esp_timer_get_time() when the tokens were last added
+	uint32_t rate;  // logs per second, 0 for no limit
+	uint32_t burst;
+	uint32_t suppressed; // since the last report
+} LIMIT_BUCKET_t;
+
+typedef struct {
+	char tag[LIMIT_TAG_SIZE];
+	uint32_t rate;
+	uint32_t burst;
+} LIMIT_RULE_t;
+
+typedef struct {
+	const char *tag;
+	LIMIT_BUCKET_t bucket;
+} LIMIT_SLOT_t;
+
+static LIMIT_RULE_t limit_rules[LIMIT_RULES];
+static int limit_rules_len;
+static LIMIT_RULE_t limit_default = { "*", CONFIG_NET_LOGGING_TAG_RATE, CONFIG_NET_LOGGING_TAG_BURST };
+#define LIMIT_BUCKET_INIT(r, b) { .tokens = (b) * LIMIT_TOKEN, .rate = (r), .burst = (b) }
+static LIMIT_SLOT_t limit_slots[LIMIT_SLOTS + 1] = {
+	[LIMIT_SLOTS] = { .bucket = LIMIT_BUCKET_INIT(CONFIG_NET_LOGGING_TAG_RATE, CONFIG_NET_LOGGING_TAG_BURST) },
+};
+static LIMIT_BUCKET_t limit_sinks[NET_LOGGING_SINKS] = {
+	[0 ... NET_LOGGING_SINKS - 1] = LIMIT_BUCKET_INIT(CONFIG_NET_LOGGING_SINK_RATE, CONFIG_NET_LOGGING_SINK_BURST),
+};
+static portMUX_TYPE limit_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void logging_stats_suppressed(int sink, uint32_t records);
+const char *logging_sink_name(int sink);
+void logging_report(void);
+
+// Set by the timer every CONFIG_NET_LOGGING_RATE_REPORT seconds, see logging_limit_report()
+static atomic_bool limit_due;
+
+static void limit_bucket_set(LIMIT_BUCKET_t *bucket, uint32_t rate, uint32_t burst) {
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst * LIMIT_TOKEN;
+	bucket->last = esp_timer_get_time();
+}
+
+// Take a token for one log, or count it as suppressed
+static bool limit_bucket_take(LIMIT_BUCKET_t *bucket, int64_t now) {
+	if (bucket->rate == 0) return true;
+	bucket->tokens += (now - bucket->last) * bucket->rate;
+	bucket->last = now;
+	if (bucket->tokens > bucket->burst * LIMIT_TOKEN) bucket->tokens = bucket->burst * LIMIT_TOKEN;
+	if (bucket->tokens < LIMIT_TOKEN) {
+		bucket->suppressed++;
+		return false;
+	}
+	bucket->tokens -= LIMIT_TOKEN;
+	return true;
+}
+
+// Give back the token of a log that was not sent after all
+static void limit_bucket_refund(LIMIT_BUCKET_t *bucket) {
+	if (bucket->rate == 0) return;
+	bucket->tokens += LIMIT_TOKEN;
+	if (bucket->tokens > bucket->burst * LIMIT_TOKEN) bucket->tokens = bucket->burst * LIMIT_TOKEN;
+}
+
+static LIMIT_RULE_t *limit_rule(const char *tag) {
+	for (int i = 0; i < limit_rules_len; i++) {
+		if (strcmp(limit_rules[i].tag, tag) == 0) return &limit_rules[i];
+	}
+	return &limit_default;
+}
+
+static LIMIT_BUCKET_t *limit_tag_bucket(const char *tag) {
+	uint32_t hash = ((uintptr_t)tag >> 2) * 2654435761u;
+	for (int probe = 0; probe < LIMIT_PROBES; probe++) {
+		LIMIT_SLOT_t *slot = &limit_slots[(hash + probe) % LIMIT_SLOTS];
+		if (slot->tag == tag) return &slot->bucket;
+		if (slot->tag == NULL) {
+			LIMIT_RULE_t *rule = limit_rule(tag);
+			slot->tag = tag;
+			limit_bucket_set(&slot->bucket, rule->rate, rule->burst);
+			return &slot->bucket;
+		}
+	}
+	return &limit_slots[LIMIT_SLOTS].bucket;
+}
+
+// Called by logging_vprintf() before the log is formatted, with the sinks that want it.
+// Returns the sinks whose bucket and the bucket of the tag had room for it.
+uint32_t logging_limit(const char *tag, uint32_t sinks) {
+	if (sinks == 0) return 0;
+	uint32_t allowed = 0;
+	int64_t now = esp_timer_get_time();
+	portENTER_CRITICAL_SAFE(&limit_lock);
+	// A log not made by ESP_LOGx() has no tag, it is only limited by the sinks
+	if (tag == NULL || limit_bucket_take(limit_tag_bucket(tag), now)) {
+		for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+			if ((sinks & (1 << sink)) == 0) continue;
+			if (limit_bucket_take(&limit_sinks[sink], now)) allowed |= 1 << sink;
+		}
+	}
+	portEXIT_CRITICAL_SAFE(&limit_lock);
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if ((sinks & ~allowed) & (1 << sink)) logging_stats_suppressed(sink, 1);
+	}
+	return allowed;
+}
+
+// Called by logging_vprintf() for a log that logging_limit() allowed to sinks, but that the dedup took out as a repeat.
+// The tokens go back, so that repeats only use the tokens of the one log they are reported by.
+void logging_limit_refund(const char *tag, uint32_t sinks) {
+	if (sinks == 0) return;
+	portENTER_CRITICAL_SAFE(&limit_lock);
+	if (tag != NULL) limit_bucket_refund(limit_tag_bucket(tag));
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if (sinks & (1 << sink)) limit_bucket_refund(&limit_sinks[sink]);
+	}
+	portEXIT_CRITICAL_SAFE(&limit_lock);
+}
+
+static uint32_t limit_take_suppressed(LIMIT_BUCKET_t *bucket) {
+	portENTER_CRITICAL_SAFE(&limit_lock);
+	uint32_t suppressed = bucket->suppressed;
+	bucket->suppressed = 0;
+	portEXIT_CRITICAL_SAFE(&limit_lock);
+	return suppressed;
+}
+
+// Runs in the esp_timer task, which only hands the report over
+static void limit_timeout(void *arg) {
+	atomic_store(&limit_due, true);
+	logging_report();
+}
+
+// Called by the report task of net_logging.c.
+// The reports are logs themselves, so that every sink gets them in its own format.
+void logging_limit_report(void) {
+	static const char *TAG = "net_logging";
+	if (!atomic_exchange(&limit_due, false)) return;
+	for (int i = 0; i <= LIMIT_SLOTS; i++) {
+		const char *tag = (i < LIMIT_SLOTS) ? limit_slots[i].tag : "(other tags)";
+		if (tag == NULL) continue;
+		uint32_t suppressed = limit_take_suppressed(&limit_slots[i].bucket);
+		if (suppressed == 0) continue;
+		ESP_LOGW(TAG, "tag %s: suppressed %"PRIu32" lines in last %ds", tag, suppressed, CONFIG_NET_LOGGING_RATE_REPORT);
+	}
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		uint32_t suppressed = limit_take_suppressed(&limit_sinks[sink]);
+		if (suppressed == 0) continue;
+		ESP_LOGW(TAG, "sink %s: suppressed %"PRIu32" lines in last %ds", logging_sink_name(sink), suppressed, CONFIG_NET_LOGGING_RATE_REPORT);
+	}
+}
+
+// Done once, by the first *_logging_init()
+void logging_limit_start(void) {
+	esp_timer_create_args_t args = {
+		.callback = limit_timeout,
+		.name = "net_logging_limit",
+	};
+	esp_timer_handle_t timer;
+	if (esp_timer_create(&args, &timer) != ESP_OK || esp_timer_start_periodic(timer, CONFIG_NET_LOGGING_RATE_REPORT * 1000000LL) != ESP_OK) {
+		printf("suppressed logs are not reported\n");
+	}
+}
+
+// Limit the logs of tag to rate per second, rate 0 for no limit. tag "*" sets the limit of the tags without one of their own.
+esp_err_t net_logging_tag_rate_set(const char *tag, uint32_t rate, uint32_t burst) {
+	if (tag == NULL || strlen(tag) >= LIMIT_TAG_SIZE || burst == 0) return ESP_ERR_INVALID_ARG;
+	esp_err_t ret = ESP_OK;
+	portENTER_CRITICAL_SAFE(&limit_lock);
+	LIMIT_RULE_t *rule = (strcmp(tag, "*") == 0) ? &limit_default : limit_rule(tag);
+	if (rule == &limit_default && strcmp(tag, "*") != 0) {
+		rule = NULL;
+		if (limit_rules_len < LIMIT_RULES) {
+			rule = &limit_rules[limit_rules_len++];
+			strcpy(rule->tag, tag);
+		}
+	}
+	if (rule != NULL) {
+		rule->rate = rate;
+		rule->burst = burst;
+		// The tags seen so far get the new limits, the shared bucket keeps the default
+		for (int i = 0; i < LIMIT_SLOTS; i++) {
+			if (limit_slots[i].tag == NULL) continue;
+			LIMIT_RULE_t *r = limit_rule(limit_slots[i].tag);
+			limit_slots[i].bucket.rate = r->rate;
+			limit_slots[i].bucket.burst = r->burst;
+		}
+		limit_slots[LIMIT_SLOTS].bucket.rate = limit_default.rate;
+		limit_slots[LIMIT_SLOTS].bucket.burst = limit_default.burst;
+	} else {
+		ret = ESP_ERR_NO_MEM;
+	}
+	portEXIT_CRITICAL_SAFE(&limit_lock);
+	return ret;
+}
+
+// Limit the logs sent to sink to rate per second, rate 0 for no limit
+esp_err_t net_logging_sink_rate_set(int sink, uint32_t rate, uint32_t burst) {
+	if (sink < 0 || sink >= NET_LOGGING_SINKS || burst == 0) return ESP_ERR_INVALID_ARG;
+	portENTER_CRITICAL_SAFE(&limit_lock);
+	limit_sinks[sink].rate = rate;
+	limit_sinks[sink].burst = burst;
+	portEXIT_CRITICAL_SAFE(&limit_lock);
+	return ESP_OK;
+}
+
+#else
+
+esp_err_t net_logging_tag_rate_set(const char *tag, uint32_t rate, uint32_t burst) {
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t net_logging_sink_rate_set(int sink, uint32_t rate, uint32_t burst) {
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
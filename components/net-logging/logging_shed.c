@@ -0,0 +1,175 @@
+/*
+	Logging load shedding
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "net_logging.h"
+
+#if CONFIG_NET_LOGGING_SHED
+
+// Stage 1 samples VERBOSE, stage 2 DEBUG as well and stage 3 INFO as well.
+// A sink goes up as soon as its buffer passes a watermark, or when it has dropped logs.
+// It goes down one stage at a time, once the buffer is below the watermark by SHED_HYSTERESIS
+// and the sink has sent at least as much as was queued for SHED_CALM checks in a row.
+#define SHED_STAGES 3
+#define SHED_PERIOD_US 100000
+#define SHED_HYSTERESIS 10
+#define SHED_CALM 10
+
+static const int shed_watermarks[SHED_STAGES] = { CONFIG_NET_LOGGING_SHED_VERBOSE, CONFIG_NET_LOGGING_SHED_DEBUG, CONFIG_NET_LOGGING_SHED_INFO };
+static const char *shed_levels[SHED_STAGES] = { "VERBOSE", "DEBUG and VERBOSE", "INFO, DEBUG and VERBOSE" };
+
+// Read by logging_vprintf(), written by shed_control() only
+static atomic_uint shed_stage[NET_LOGGING_SINKS];
+static atomic_uint shed_count[NET_LOGGING_SINKS];
+
+// Used by shed_control() only
+static NET_LOGGING_STATS_t shed_last;
+static int shed_calm[NET_LOGGING_SINKS];
+
+// The checks run only while a buffer is above the first watermark or a sink samples, see logging_shed_check()
+static esp_timer_handle_t shed_timer;
+static atomic_bool shed_running;
+
+// A change of stage left by shed_control() for logging_shed_report(): SHED_REPORTED, the stage and the fill
+#define SHED_REPORTED 0x10000
+static atomic_uint shed_reports[NET_LOGGING_SINKS];
+
+void logging_stats_suppressed(int sink, uint32_t records);
+const char *logging_sink_name(int sink);
+size_t logging_used(int sink);
+void logging_note(const char *tag, uint8_t level, const char *message);
+void logging_report(void);
+
+// Called by logging_vprintf() before the log is formatted, with the sinks that want it.
+// Returns the sinks that keep it, a sink that samples the level keeps 1 in CONFIG_NET_LOGGING_SHED_KEEP.
+uint32_t logging_shed(uint8_t level, uint32_t sinks) {
+	// A log not made by ESP_LOGx() is sampled like INFO, WARN and ERROR never
+	if (level == 0) level = ESP_LOG_INFO;
+	if (level < ESP_LOG_INFO) return sinks;
+	uint32_t kept = sinks;
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if ((sinks & (1 << sink)) == 0) continue;
+		unsigned int stage = atomic_load_explicit(&shed_stage[sink], memory_order_relaxed);
+		if (stage == 0 || level <= ESP_LOG_VERBOSE - stage) continue;
+		if (atomic_fetch_add_explicit(&shed_count[sink], 1, memory_order_relaxed) % CONFIG_NET_LOGGING_SHED_KEEP == 0) continue;
+		kept &= ~(1 << sink);
+		logging_stats_suppressed(sink, 1);
+	}
+	return kept;
+}
+
+// Called by logging_vprintf() for a log that logging_shed() kept for sinks, but that the dedup took out as a repeat.
+// The count of the sampled levels goes back, so that 1 in CONFIG_NET_LOGGING_SHED_KEEP of the logs that are sent is kept.
+void logging_shed_refund(uint8_t level, uint32_t sinks) {
+	if (level == 0) level = ESP_LOG_INFO;
+	if (level < ESP_LOG_INFO) return;
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if ((sinks & (1 << sink)) == 0) continue;
+		unsigned int stage = atomic_load_explicit(&shed_stage[sink], memory_order_relaxed);
+		if (stage == 0 || level <= ESP_LOG_VERBOSE - stage) continue;
+		atomic_fetch_sub_explicit(&shed_count[sink], 1, memory_order_relaxed);
+	}
+}
+
+// Called by the report task of net_logging.c
+void logging_shed_report(void) {
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		unsigned int report = atomic_exchange(&shed_reports[sink], 0);
+		if (report == 0) continue;
+		int stage = (report >> 8) & 0xff;
+		int fill = report & 0xff;
+		char message[96];
+		if (stage == 0) {
+			snprintf(message, sizeof(message), "sink %s: buffer %d%% full, keeping all logs again", logging_sink_name(sink), fill);
+		} else {
+			snprintf(message, sizeof(message), "sink %s: buffer %d%% full, keeping 1 in %d of %s", logging_sink_name(sink), fill,
+				CONFIG_NET_LOGGING_SHED_KEEP, shed_levels[stage - 1]);
+		}
+		logging_note("net_logging", ESP_LOG_WARN, message);
+	}
+}
+
+// Called by logging_send() of net_logging.c for every log, with the bytes in the buffer after it.
+// Starts the checks when the buffer has passed the first watermark, or the log didn't fit.
+void logging_shed_check(int sink, bool queued, size_t used) {
+	if (queued && used * 100 < CONFIG_NET_LOGGING_SHED_VERBOSE * xBufferSizeBytes) return;
+	if (shed_timer == NULL || atomic_load(&shed_running) || atomic_exchange(&shed_running, true)) return;
+	// The first check counts from now, not from when the checks last stopped.
+	// The timer is stopped, so shed_control() doesn't use shed_last meanwhile.
+	net_logging_get_stats(&shed_last);
+	// The log that didn't fit is the first drop the check sees
+	if (!queued) shed_last.sink[sink].dropped--;
+	if (esp_timer_start_once(shed_timer, SHED_PERIOD_US) != ESP_OK) atomic_store(&shed_running, false);
+}
+
+// Runs in the esp_timer task every SHED_PERIOD_US, while a buffer is filling up or a sink samples
+static void shed_control(void *arg) {
+	NET_LOGGING_STATS_t stats;
+	net_logging_get_stats(&stats);
+	bool active = false;
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		NET_LOGGING_SINK_STATS_t *now = &stats.sink[sink];
+		NET_LOGGING_SINK_STATS_t *last = &shed_last.sink[sink];
+		uint32_t queued = now->enqueued - last->enqueued;
+		uint32_t sent = now->sent - last->sent;
+		uint32_t dropped = now->dropped - last->dropped;
+		int fill = logging_used(sink) * 100 / xBufferSizeBytes;
+
+		int stage = atomic_load(&shed_stage[sink]);
+		int target = 0;
+		while (target < SHED_STAGES && fill >= shed_watermarks[target]) target++;
+		// The buffer was full at some point since the last check
+		if (dropped > 0 && target <= stage && stage < SHED_STAGES) target = stage + 1;
+
+		int next = stage;
+		if (target > stage) {
+			next = target;
+			shed_calm[sink] = 0;
+		} else if (stage > 0 && fill < shed_watermarks[stage - 1] - SHED_HYSTERESIS && sent >= queued) {
+			if (++shed_calm[sink] >= SHED_CALM) {
+				next = stage - 1;
+				shed_calm[sink] = 0;
+			}
+		} else {
+			shed_calm[sink] = 0;
+		}
+		if (next != stage) {
+			atomic_store(&shed_stage[sink], next);
+			// Logged by the report task, the esp_timer task only hands it over
+			atomic_store(&shed_reports[sink], SHED_REPORTED | (next << 8) | fill);
+			logging_report();
+		}
+		if (next > 0 || fill >= shed_watermarks[0]) active = true;
+	}
+	shed_last = stats;
+	// Stop until logging_shed_check() sees a buffer fill up again
+	if (!active || esp_timer_start_once(shed_timer, SHED_PERIOD_US) != ESP_OK) atomic_store(&shed_running, false);
+}
+
+// Done once, by the first *_logging_init()
+void logging_shed_start(void) {
+	esp_timer_create_args_t args = {
+		.callback = shed_control,
+		.name = "net_logging_shed",
+	};
+	if (esp_timer_create(&args, &shed_timer) != ESP_OK) {
+		shed_timer = NULL;
+		printf("logs are not sampled when a buffer fills up\n");
+	}
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+	Logging statistics
+
+	This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+	Unless required by applicable law or agreed to in writing, this
+	software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+	CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "net_logging.h"
+
+// Upper bounds of the latency buckets in microseconds, the last bucket has none
+static const uint32_t logging_latency_bounds[NET_LOGGING_LATENCY_BUCKETS - 1] = { 100, 1000, 10000, 100000, 1000000 };
+static const char *logging_sink_names[NET_LOGGING_SINKS] = { "udp", "tcp", "mqtt", "http", "sse", "file" };
+
+// Updated by logging_vprintf() and the sink tasks at the same time, so every counter is atomic.
+// Relaxed order is enough, the counters don't guard any other data.
+typedef struct {
+	atomic_uint enqueued;
+	atomic_uint enqueued_bytes;
+	atomic_uint dropped;
+	atomic_uint suppressed;
+	atomic_uint sent;
+	atomic_uint sent_bytes;
+	atomic_uint high_water;
+	atomic_uint latency[NET_LOGGING_LATENCY_BUCKETS];
+} LOGGING_STATS_t;
+
+static atomic_uint logging_stats_logs;
+static LOGGING_STATS_t logging_stats[NET_LOGGING_SINKS];
+
+#define STATS_ADD(counter, value) atomic_fetch_add_explicit(&(counter), (value), memory_order_relaxed)
+#define STATS_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+// Called by logging_vprintf() for every log
+void logging_stats_log(void) {
+	STATS_ADD(logging_stats_logs, 1);
+}
+
+// Called by logging_vprintf() for every sink. used is the number of bytes in the buffer after the log.
+void logging_stats_enqueue(int sink, bool queued, size_t len, size_t used) {
+	LOGGING_STATS_t *stats = &logging_stats[sink];
+	if (!queued) {
+		STATS_ADD(stats->dropped, 1);
+		return;
+	}
+	STATS_ADD(stats->enqueued, 1);
+	STATS_ADD(stats->enqueued_bytes, len);
+	unsigned int high_water = STATS_GET(stats->high_water);
+	while (used > high_water) {
+		if (atomic_compare_exchange_weak_explicit(&stats->high_water, &high_water, used, memory_order_relaxed, memory_order_relaxed)) break;
+	}
+}
+
+// Called by the sink tasks when they have sent records.
+// start is esp_timer_get_time() when they were taken out of the buffer, 0 when the time doesn't tell anything.
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start) {
+	LOGGING_STATS_t *stats = &logging_stats[sink];
+	STATS_ADD(stats->sent, records);
+	STATS_ADD(stats->sent_bytes, len);
+	if (start == 0) return;
+	int64_t latency = esp_timer_get_time() - start;
+	int bucket = 0;
+	while (bucket < NET_LOGGING_LATENCY_BUCKETS - 1 && latency >= logging_latency_bounds[bucket]) bucket++;
+	STATS_ADD(stats->latency[bucket], 1);
+}
+
+// Called by the sink tasks for records they could not send
+void logging_stats_dropped(int sink, uint32_t records) {
+	STATS_ADD(logging_stats[sink].dropped, records);
+}
+
+// Called by logging_limit() and logging_shed() for logs kept from a sink
+void logging_stats_suppressed(int sink, uint32_t records) {
+	STATS_ADD(logging_stats[sink].suppressed, records);
+}
+
+const char *logging_sink_name(int sink) {
+	return logging_sink_names[sink];
+}
+
+void net_logging_get_stats(NET_LOGGING_STATS_t *stats) {
+	stats->timestamp = esp_timer_get_time();
+	stats->logs = STATS_GET(logging_stats_logs);
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		LOGGING_STATS_t *from = &logging_stats[sink];
+		NET_LOGGING_SINK_STATS_t *to = &stats->sink[sink];
+		to->enqueued = STATS_GET(from->enqueued);
+		to->enqueued_bytes = STATS_GET(from->enqueued_bytes);
+		to->dropped = STATS_GET(from->dropped);
+		to->suppressed = STATS_GET(from->suppressed);
+		to->sent = STATS_GET(from->sent);
+		to->sent_bytes = STATS_GET(from->sent_bytes);
+		to->high_water = STATS_GET(from->high_water);
+		for (int bucket = 0; bucket < NET_LOGGING_LATENCY_BUCKETS; bucket++) {
+			to->latency[bucket] = STATS_GET(from->latency[bucket]);
+		}
+	}
+}
+
+// The statistics as JSON, for /stats of the SSE server. Returns the length, which is less than size.
+size_t logging_stats_json(char *buffer, size_t size) {
+	NET_LOGGING_STATS_t stats;
+	net_logging_get_stats(&stats);
+
+	size_t len = 0;
+#define JSON(...) do { \
+		int n = snprintf(buffer + len, size - len, __VA_ARGS__); \
+		if (n > 0) len = (len + n < size) ? len + n : size - 1; \
+	} while (0)
+	JSON("{\"uptime_us\":%"PRId64",\"logs\":%"PRIu32",\"buffer_size\":%d,\"latency_bounds_us\":[", stats.timestamp, stats.logs, xBufferSizeBytes);
+	for (int bucket = 0; bucket < NET_LOGGING_LATENCY_BUCKETS - 1; bucket++) {
+		JSON("%s%"PRIu32, bucket ? "," : "", logging_latency_bounds[bucket]);
+	}
+	JSON("],\"sinks\":{");
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		NET_LOGGING_SINK_STATS_t *s = &stats.sink[sink];
+		JSON("%s\"%s\":{\"enqueued\":%"PRIu32",\"enqueued_bytes\":%"PRIu32",\"dropped\":%"PRIu32
+			",\"suppressed\":%"PRIu32",\"sent\":%"PRIu32",\"sent_bytes\":%"PRIu32",\"high_water\":%"PRIu32",\"latency\":[",
+			sink ? "," : "", logging_sink_names[sink], s->enqueued, s->enqueued_bytes, s->dropped,
+			s->suppressed, s->sent, s->sent_bytes, s->high_water);
+		for (int bucket = 0; bucket < NET_LOGGING_LATENCY_BUCKETS; bucket++) {
+			JSON("%s%"PRIu32, bucket ? "," : "", s->latency[bucket]);
+		}
+		JSON("]}");
+	}
+	JSON("}}");
+#undef JSON
+	return len;
+}
@@ -21,20 +21,33 @@
 #endif
 #include "esp_log.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 #include "esp_mac.h" // esp_base_mac_addr_get
 #include "mqtt_client.h"
 
 #include "net_logging.h"
+#include "log_record.h"
+
+#ifndef CONFIG_NET_LOGGING_TAG_INTERVAL
+#define CONFIG_NET_LOGGING_TAG_INTERVAL 60
+#endif
 
 EventGroupHandle_t mqtt_status_event_group;
 #define MQTT_CONNECTED_BIT BIT2
+// Set on each connect, the tags are defined again on the new session
+#define MQTT_SESSION_BIT BIT3
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-extern RingbufHandle_t xRingBufferMQTT;
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
 #else
-extern MessageBufferHandle_t xMessageBufferMQTT;
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
 #endif
 
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+void logging_stats_dropped(int sink, uint32_t records);
+void logging_ready(int sink, TaskHandle_t taskHandle);
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void));
+
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 #else
@@ -47,7 +60,7 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 	switch (event->event_id) {
 		case MQTT_EVENT_CONNECTED:
 			//ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-			xEventGroupSetBits(mqtt_status_event_group, MQTT_CONNECTED_BIT);
+			xEventGroupSetBits(mqtt_status_event_group, MQTT_CONNECTED_BIT | MQTT_SESSION_BIT);
 			break;
 		case MQTT_EVENT_DISCONNECTED:
 			//ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
@@ -77,6 +90,42 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 #endif
 }
 
+static esp_mqtt_client_handle_t mqtt_client;
+static char mqtt_topic[64];
+#if CONFIG_LOG_MQTT_BINARY
+static LOG_RECORD_TAGS_t mqtt_tags;
+#endif
+
+// Publish one log, called by the task and by net_logging_flush()
+static bool mqtt_send(const void *data, size_t len) {
+	EventBits_t EventBits = xEventGroupGetBits(mqtt_status_event_group);
+	//printf("EventBits=%x\n", EventBits);
+	if ((EventBits & MQTT_CONNECTED_BIT) == 0) {
+		printf("Connection to MQTT broker is broken. Skip to send\n");
+		return false;
+	}
+#if CONFIG_LOG_MQTT_BINARY
+	// Define the tags again after a reconnect
+	if (xEventGroupClearBits(mqtt_status_event_group, MQTT_SESSION_BIT) & MQTT_SESSION_BIT) {
+		log_record_tags_reset(&mqtt_tags);
+	}
+	uint8_t definition[LOG_RECORD_DEFINE_SIZE];
+	size_t definition_len = log_record_tags_check(&mqtt_tags, data, len, definition, sizeof(definition));
+	if (definition_len > 0) {
+		esp_mqtt_client_publish(mqtt_client, mqtt_topic, (char *)definition, definition_len, 1, 0);
+	}
+#endif
+#if !CONFIG_LOG_MQTT_BINARY
+	// Remove trailing LF
+	if (((const char *)data)[len-1] == 0x0a) len = len - 1;
+#endif
+	if (len) {
+		esp_mqtt_client_publish(mqtt_client, mqtt_topic, data, len, 1, 0);
+		//printf("sent publish successful\n");
+	}
+	return true;
+}
+
 void mqtt_pub(void *pvParameters)
 {
 	PARAMETER_t *task_parameter = pvParameters;
@@ -109,7 +158,8 @@ void mqtt_pub(void *pvParameters)
 #endif
 
 	// Connect broker
-	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+	strcpy(mqtt_topic, param.topic);
+	mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
 	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
@@ -118,6 +168,7 @@ void mqtt_pub(void *pvParameters)
 	esp_mqtt_client_start(mqtt_client);
 	xEventGroupClearBits(mqtt_status_event_group, MQTT_CONNECTED_BIT);
 
+#if !CONFIG_NET_LOGGING_ASYNC_START
 	// Wait for connection
 	//xEventGroupWaitBits(mqtt_status_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
 	EventBits_t uxBits = xEventGroupWaitBits(mqtt_status_event_group, MQTT_CONNECTED_BIT, false, true, pdMS_TO_TICKS(1000));
@@ -129,36 +180,38 @@ void mqtt_pub(void *pvParameters)
 		esp_mqtt_client_stop(mqtt_client);
 		vTaskDelete(NULL);
 	}
+#endif
 
-	// Send ready to receive notify
-	xTaskNotifyGive(param.taskHandle);
+#if CONFIG_LOG_MQTT_BINARY
+	// Subscribers may come at any time, and the broker doesn't keep the definitions
+	log_record_tags_init(&mqtt_tags, pdMS_TO_TICKS(CONFIG_NET_LOGGING_TAG_INTERVAL * 1000));
+#endif
+	logging_flusher(NET_LOGGING_MQTT, mqtt_send, NULL);
 
 	while (1) {
+		// The client connects again by itself, the logs wait in the buffer until then
+		xEventGroupWaitBits(mqtt_status_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
+		logging_ready(NET_LOGGING_MQTT, param.taskHandle);
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 		size_t received;
-		char *buffer = (char *)xRingbufferReceive(xRingBufferMQTT, &received, portMAX_DELAY);
+		RingbufHandle_t from;
+		char *buffer = (char *)logging_receive(NET_LOGGING_MQTT, &received, portMAX_DELAY, &from);
 		//printf("xRingBufferReceive received=%d\n", received);
 #else
 		char buffer[xItemSize];
-		size_t received = xMessageBufferReceive(xMessageBufferMQTT, buffer, sizeof(buffer), portMAX_DELAY);
+		size_t received = logging_receive(NET_LOGGING_MQTT, buffer, sizeof(buffer), portMAX_DELAY);
 		//printf("xMessageBufferReceive received=%d\n", received);
 #endif
 		if (received > 0) {
 			//printf("xMessageBufferReceive buffer=[%.*s]\n",received, buffer);
-			EventBits_t EventBits = xEventGroupGetBits(mqtt_status_event_group);
-			//printf("EventBits=%x\n", EventBits);
-			if (EventBits & MQTT_CONNECTED_BIT) {
-				// Remove trailing LF
-				if (buffer[received-1] == 0x0a) received = received - 1;
-				if (received) {
-					esp_mqtt_client_publish(mqtt_client, param.topic, buffer, received, 1, 0);
-					//printf("sent publish successful\n");
-				}
+			int64_t start = esp_timer_get_time();
+			if (mqtt_send(buffer, received)) {
+				logging_stats_sent(NET_LOGGING_MQTT, 1, received, start);
 			} else {
-				printf("Connection to MQTT broker is broken. Skip to send\n");
+				logging_stats_dropped(NET_LOGGING_MQTT, 1);
 			}
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-			vRingbufferReturnItem(xRingBufferMQTT, (void *)buffer);
+			vRingbufferReturnItem(from, (void *)buffer);
 #endif
 		} else {
 			printf("xMessageBufferReceive fail\n");
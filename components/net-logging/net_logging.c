@@ -1,9 +1,10 @@
 #include <string.h>
-#include <assert.h>
+#include <stdatomic.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 #include "freertos/ringbuf.h"
 #else
@@ -12,8 +13,10 @@
 
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "net_logging.h"
+#include "log_record.h"
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 RingbufHandle_t xRingBufferUDP = NULL;
@@ -21,6 +24,7 @@ RingbufHandle_t xRingBufferTCP = NULL;
 RingbufHandle_t xRingBufferMQTT = NULL;
 RingbufHandle_t xRingBufferHTTP = NULL;
 RingbufHandle_t xRingBufferSSE = NULL;
+RingbufHandle_t xRingBufferFILE = NULL;
 //RingbufHandle_t xRingBufferTrans;
 #else
 MessageBufferHandle_t xMessageBufferUDP = NULL;
@@ -28,15 +32,396 @@ MessageBufferHandle_t xMessageBufferTCP = NULL;
 MessageBufferHandle_t xMessageBufferMQTT = NULL;
 MessageBufferHandle_t xMessageBufferHTTP = NULL;
 MessageBufferHandle_t xMessageBufferSSE = NULL;
+MessageBufferHandle_t xMessageBufferFILE = NULL;
 //MessageBufferHandle_t xMessageBufferTrans;
 #endif
 bool writeToStdout;
 
+// The buffers by sink, NET_LOGGING_UDP ...
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static RingbufHandle_t *logging_buffers[NET_LOGGING_SINKS] = { &xRingBufferUDP, &xRingBufferTCP, &xRingBufferMQTT, &xRingBufferHTTP, &xRingBufferSSE, &xRingBufferFILE };
+#else
+static MessageBufferHandle_t *logging_buffers[NET_LOGGING_SINKS] = { &xMessageBufferUDP, &xMessageBufferTCP, &xMessageBufferMQTT, &xMessageBufferHTTP, &xMessageBufferSSE, &xMessageBufferFILE };
+#endif
+
+// WARN and ERROR go into a small buffer of their own, so that they are neither dropped nor kept waiting
+// when INFO fills the buffer of a sink. The sink task takes them first, see logging_receive().
+#ifndef CONFIG_NET_LOGGING_PRIORITY_SIZE
+#define CONFIG_NET_LOGGING_PRIORITY_SIZE 512
+#endif
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static RingbufHandle_t logging_high[NET_LOGGING_SINKS];
+#else
+static MessageBufferHandle_t logging_high[NET_LOGGING_SINKS];
+#endif
+
+// A log put into the priority lane is followed by this in the buffer of the sink,
+// which wakes up a sink task that is waiting there. It is a single 0, no log looks like that.
+#define LOGGING_DOORBELL_LEN 1
+
+// logging_vprintf() calls that may still hold a buffer handle, see logging_remove()
+static atomic_uint logging_writers;
+
+// Sinks that are sent binary records instead of text, see log_record.h
+#if CONFIG_LOG_UDP_BINARY
+#define UDP_BINARY true
+#define UDP_DATA record
+#define UDP_LEN record_len
+#else
+#define UDP_BINARY false
+#define UDP_DATA &buffer
+#define UDP_LEN strlen(buffer)
+#endif
+#if CONFIG_LOG_TCP_BINARY
+#define TCP_BINARY true
+#define TCP_DATA record
+#define TCP_LEN record_len
+#else
+#define TCP_BINARY false
+#define TCP_DATA &buffer
+#define TCP_LEN strlen(buffer)
+#endif
+#if CONFIG_LOG_MQTT_BINARY
+#define MQTT_BINARY true
+#define MQTT_DATA record
+#define MQTT_LEN record_len
+#else
+#define MQTT_BINARY false
+#define MQTT_DATA &buffer
+#define MQTT_LEN strlen(buffer)
+#endif
+#if CONFIG_LOG_FILE_BINARY
+#define FILE_BINARY true
+#define FILE_DATA record
+#define FILE_LEN record_len
+#else
+#define FILE_BINARY false
+#define FILE_DATA &buffer
+#define FILE_LEN strlen(buffer)
+#endif
+#define LOGGING_BINARY (CONFIG_LOG_UDP_BINARY || CONFIG_LOG_TCP_BINARY || CONFIG_LOG_MQTT_BINARY || CONFIG_LOG_FILE_BINARY)
+static const bool logging_binary[NET_LOGGING_SINKS] = { UDP_BINARY, TCP_BINARY, MQTT_BINARY, false, false, FILE_BINARY };
+#define LOGGING_BINARY_SINKS ((UDP_BINARY << NET_LOGGING_UDP) | (TCP_BINARY << NET_LOGGING_TCP) | (MQTT_BINARY << NET_LOGGING_MQTT) | (FILE_BINARY << NET_LOGGING_FILE))
+// The dedup compares the text of every log
+#if CONFIG_NET_LOGGING_DEDUP
+#define LOGGING_TEXT_ALWAYS true
+#else
+#define LOGGING_TEXT_ALWAYS false
+#endif
+
+void logging_stats_log(void);
+void logging_stats_enqueue(int sink, bool queued, size_t len, size_t used);
+void logging_stats_dropped(int sink, uint32_t records);
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+const char *logging_sink_name(int sink);
+uint32_t logging_filter(const char *tag, uint8_t level);
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+uint32_t logging_limit(const char *tag, uint32_t sinks);
+void logging_limit_refund(const char *tag, uint32_t sinks);
+void logging_limit_start(void);
+void logging_limit_report(void);
+#endif
+#if CONFIG_NET_LOGGING_DEDUP
+bool logging_dedup(const char *tag, uint8_t level, const char *text);
+void logging_dedup_start(void);
+#endif
+#if CONFIG_NET_LOGGING_SHED
+uint32_t logging_shed(uint8_t level, uint32_t sinks);
+void logging_shed_refund(uint8_t level, uint32_t sinks);
+void logging_shed_start(void);
+void logging_shed_check(int sink, bool queued, size_t used);
+void logging_shed_report(void);
+#endif
+
+// Count a log put into the buffer of a sink, or dropped as the buffer was full
+static void logging_enqueued(int sink, bool queued, size_t len, size_t used) {
+	logging_stats_enqueue(sink, queued, len, used);
+#if CONFIG_NET_LOGGING_SHED
+	logging_shed_check(sink, queued, used);
+#endif
+}
+
+// Put a log into the buffer of a sink, WARN and ERROR into its priority lane when there is room
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static void logging_send(int sink, RingbufHandle_t buffer, const void *data, size_t len, bool priority, BaseType_t *pxHigherPriorityTaskWoken) {
+	if (priority) {
+		RingbufHandle_t high = __atomic_load_n(&logging_high[sink], __ATOMIC_SEQ_CST);
+		if (high != NULL && xRingbufferSendFromISR(high, data, len, pxHigherPriorityTaskWoken) == pdTRUE) {
+			// If the buffer is full, the sink task is busy and doesn't need waking up
+			xRingbufferSendFromISR(buffer, "", LOGGING_DOORBELL_LEN, pxHigherPriorityTaskWoken);
+			logging_enqueued(sink, true, len, xBufferSizeBytes - xRingbufferGetCurFreeSize(buffer));
+			return;
+		}
+		// The priority lane is full, the log queues with the others
+	}
+	BaseType_t sended = xRingbufferSendFromISR(buffer, data, len, pxHigherPriorityTaskWoken);
+	logging_enqueued(sink, sended == pdTRUE, len, xBufferSizeBytes - xRingbufferGetCurFreeSize(buffer));
+}
+#else
+static void logging_send(int sink, MessageBufferHandle_t buffer, const void *data, size_t len, bool priority, BaseType_t *pxHigherPriorityTaskWoken) {
+	if (priority) {
+		MessageBufferHandle_t high = __atomic_load_n(&logging_high[sink], __ATOMIC_SEQ_CST);
+		if (high != NULL && xMessageBufferSendFromISR(high, data, len, pxHigherPriorityTaskWoken) == len) {
+			// If the buffer is full, the sink task is busy and doesn't need waking up
+			xMessageBufferSendFromISR(buffer, "", LOGGING_DOORBELL_LEN, pxHigherPriorityTaskWoken);
+			logging_enqueued(sink, true, len, xBufferSizeBytes - xMessageBufferSpacesAvailable(buffer));
+			return;
+		}
+		// The priority lane is full, the log queues with the others
+	}
+	size_t sended = xMessageBufferSendFromISR(buffer, data, len, pxHigherPriorityTaskWoken);
+	logging_enqueued(sink, sended == len, len, xBufferSizeBytes - xMessageBufferSpacesAvailable(buffer));
+}
+#endif
+
+// net_logging_flush() sends the queued logs of a sink itself while the sink task waits in logging_receive()
+#define LOGGING_RUN    0
+#define LOGGING_PARK   1 // net_logging_flush() asks the sink task to wait
+#define LOGGING_PARKED 2 // the sink task waits until it is notified
+static int logging_park_state[NET_LOGGING_SINKS];
+static portMUX_TYPE logging_park_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t logging_parked;
+
+// Called by the sink task between two logs, when it holds no log and doesn't use its connection
+static void logging_park(int sink) {
+	taskENTER_CRITICAL(&logging_park_lock);
+	bool park = (logging_park_state[sink] == LOGGING_PARK);
+	if (park) logging_park_state[sink] = LOGGING_PARKED;
+	taskEXIT_CRITICAL(&logging_park_lock);
+	if (!park) return;
+	xSemaphoreGive(logging_parked);
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+// Take the next log of a sink, the priority lane first, and wait in logging_park() on the way when asked to.
+// Returns NULL when nothing came within xTicksToWait. Give the item back with vRingbufferReturnItem(*from, item).
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static void *logging_take(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from, bool park) {
+	RingbufHandle_t buffer = *logging_buffers[sink];
+	RingbufHandle_t high = logging_high[sink];
+	while (1) {
+		if (park) logging_park(sink);
+		if (high != NULL) {
+			void *item = xRingbufferReceive(high, received, 0);
+			if (item != NULL) {
+				*from = high;
+				return item;
+			}
+		}
+		void *item = xRingbufferReceive(buffer, received, xTicksToWait);
+		*from = buffer;
+		if (item == NULL || *received != LOGGING_DOORBELL_LEN || *(uint8_t *)item != 0) return item;
+		vRingbufferReturnItem(buffer, item);
+	}
+}
+
+// Called by the sink tasks for the next log
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from) {
+	return logging_take(sink, received, xTicksToWait, from, true);
+}
+
+// Called by a sink task that collects a batch, for the logs already queued behind the first.
+// It doesn't park, so the task sends its batch before net_logging_flush() can take over.
+void *logging_receive_queued(int sink, size_t *received, RingbufHandle_t *from) {
+	return logging_take(sink, received, 0, from, false);
+}
+#else
+// Returns 0 when nothing came within xTicksToWait.
+static size_t logging_take(int sink, void *data, size_t size, TickType_t xTicksToWait, bool park) {
+	MessageBufferHandle_t buffer = *logging_buffers[sink];
+	MessageBufferHandle_t high = logging_high[sink];
+	while (1) {
+		if (park) logging_park(sink);
+		if (high != NULL) {
+			size_t received = xMessageBufferReceive(high, data, size, 0);
+			if (received > 0) return received;
+		}
+		size_t received = xMessageBufferReceive(buffer, data, size, xTicksToWait);
+		if (received != LOGGING_DOORBELL_LEN || *(uint8_t *)data != 0) return received;
+	}
+}
+
+// Called by the sink tasks for the next log
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait) {
+	return logging_take(sink, data, size, xTicksToWait, true);
+}
+
+// Called by a sink task that collects a batch, for the logs already queued behind the first.
+// It doesn't park, so the task sends its batch before net_logging_flush() can take over.
+size_t logging_receive_queued(int sink, void *data, size_t size) {
+	return logging_take(sink, data, size, 0, false);
+}
+#endif
+
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+void crash_tail_init(void);
+void crash_tail_text(const char *text, size_t len);
+void crash_tail_record(const char *tag, const uint8_t *record, size_t len);
+const char *crash_tail_reason_get(void);
+bool crash_tail_line(size_t *pos, char *line, size_t size);
+#endif
+
+// The sinks that have a buffer, as bits 1 << NET_LOGGING_UDP ...
+static uint32_t logging_active(void) {
+	uint32_t active = 0;
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if (__atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST) != NULL) active |= 1 << sink;
+	}
+	return active;
+}
+
+#if CONFIG_NET_LOGGING_SHED
+// Bytes waiting in the buffer of a sink, for logging_shed.c
+size_t logging_used(int sink) {
+	size_t used = 0;
+	atomic_fetch_add(&logging_writers, 1);
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+	RingbufHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+	if (buffer != NULL) used = xBufferSizeBytes - xRingbufferGetCurFreeSize(buffer);
+#else
+	MessageBufferHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+	if (buffer != NULL) used = xBufferSizeBytes - xMessageBufferSpacesAvailable(buffer);
+#endif
+	atomic_fetch_sub(&logging_writers, 1);
+	return used;
+}
+#endif
+
+#if CONFIG_NET_LOGGING_DEDUP || CONFIG_NET_LOGGING_SHED
+#if LOGGING_BINARY
+static size_t logging_encode(uint8_t *record, size_t size, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	size_t len = log_record_encode(record, size, esp_timer_get_time(), fmt, ap);
+	va_end(ap);
+	return len;
+}
+#endif
+
+// Send a log made by the component itself, like "last message repeated N times", to the sinks that want it.
+// It may be called by logging_vprintf() with a log on the stack, so its buffers are small.
+void logging_note(const char *tag, uint8_t level, const char *message) {
+	static const char *formats[] = {
+		LOG_FORMAT(E, "%s"),
+		LOG_FORMAT(W, "%s"),
+		LOG_FORMAT(I, "%s"),
+		LOG_FORMAT(D, "%s"),
+		LOG_FORMAT(V, "%s"),
+	};
+	if (level < ESP_LOG_ERROR || level > ESP_LOG_VERBOSE) return;
+	const char *fmt = formats[level - 1];
+	uint32_t wanted = logging_filter(tag, level) & logging_active();
+	if (wanted == 0) return;
+
+	uint32_t timestamp = esp_log_timestamp();
+	char text[96];
+	snprintf(text, sizeof(text), fmt, timestamp, tag, message);
+#if LOGGING_BINARY
+	uint8_t record[96];
+	size_t record_len = logging_encode(record, sizeof(record), fmt, timestamp, tag, message);
+#endif
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	atomic_fetch_add(&logging_writers, 1);
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if ((wanted & (1 << sink)) == 0) continue;
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+		RingbufHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+#else
+		MessageBufferHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+#endif
+		if (buffer == NULL) continue;
+#if LOGGING_BINARY
+		if (logging_binary[sink]) {
+			logging_send(sink, buffer, record, record_len, level <= ESP_LOG_WARN, &xHigherPriorityTaskWoken);
+			continue;
+		}
+#endif
+		logging_send(sink, buffer, text, strlen(text), level <= ESP_LOG_WARN, &xHigherPriorityTaskWoken);
+	}
+	atomic_fetch_sub(&logging_writers, 1);
+}
+#endif
+
+// Convert according to format.
+// l is used again for stdout, and a va_list can only be walked once on some targets, e.g. linux.
+static int logging_format(char *buffer, const char *fmt, va_list l) {
+	va_list ap;
+	va_copy(ap, l);
+	//int buffer_len = vsprintf(buffer, fmt, ap);
+	int buffer_len = vsnprintf(buffer, xItemSize, fmt, ap);
+	va_end(ap);
+	return buffer_len;
+}
+
 int logging_vprintf( const char *fmt, va_list l ) {
-	// Convert according to format
+	// The filters only need the level and tag, see net_logging_level_set().
+	// A log that no sink wants is neither formatted nor queued.
+	uint8_t level;
+	const char *tag = log_record_tag(fmt, l, &level);
+	uint32_t wanted = logging_filter(tag, level);
+	bool toStdout = writeToStdout && (wanted & (1 << NET_LOGGING_STDOUT));
+	wanted &= logging_active();
+	if (wanted == 0) {
+		return toStdout ? vprintf( fmt, l ) : 0;
+	}
+
 	char buffer[xItemSize];
-	//int buffer_len = vsprintf(buffer, fmt, l);
-	int buffer_len = vsnprintf(buffer, xItemSize, fmt, l);
+	int buffer_len = 0;
+	buffer[0] = 0;
+	bool formatted = false;
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+	// The token buckets of the tag and the sinks, before the log is formatted
+	wanted = logging_limit(tag, wanted);
+#endif
+#if CONFIG_NET_LOGGING_RATE_LIMIT && CONFIG_NET_LOGGING_DEDUP
+	// The sinks that took a token, given back for a repeat
+	uint32_t limited = wanted;
+#endif
+#if CONFIG_NET_LOGGING_SHED
+	// A sink whose buffer fills up keeps only some of the lower levels
+	if (wanted != 0) wanted = logging_shed(level, wanted);
+#endif
+#if CONFIG_NET_LOGGING_DEDUP
+	// A log that is the same as the last of its tag is only counted.
+	// Only the logs that would be sent are compared, a repeat gives back what the limits and the shedding took for it.
+	if (wanted != 0) {
+		buffer_len = logging_format(buffer, fmt, l);
+		formatted = true;
+		if (buffer_len > 0 && logging_dedup(tag, level, buffer)) {
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+			logging_limit_refund(tag, limited);
+#endif
+#if CONFIG_NET_LOGGING_SHED
+			logging_shed_refund(level, wanted);
+#endif
+			wanted = 0;
+		}
+	}
+#endif
+	if (wanted == 0) {
+		return toStdout ? vprintf( fmt, l ) : 0;
+	}
+
+#if LOGGING_BINARY
+	// The time, level, tag, core and task are taken here, while the caller is known.
+	// esp_timer is cheap to read, the sinks turn it into UTC.
+	// Only the sinks that were asked for binary records need it.
+	uint8_t record[xItemSize];
+	size_t record_len = 0;
+	if (wanted & LOGGING_BINARY_SINKS) {
+		int64_t timestamp = esp_timer_get_time();
+		record_len = log_record_encode(record, sizeof(record), timestamp, fmt, l);
+	}
+	bool text = LOGGING_TEXT_ALWAYS || (wanted & ~LOGGING_BINARY_SINKS);
+#else
+	bool text = true;
+#endif
+
+	if (text && !formatted) buffer_len = logging_format(buffer, fmt, l);
+#if LOGGING_BINARY
+	// Without the text, the record tells whether there is a log to send
+	if (!text) buffer_len = record_len;
+#endif
 
 #if 0
 	xItemSize > buffer_len
@@ -56,67 +441,426 @@ int logging_vprintf( const char *fmt, va_list l ) {
 	//printf("logging_vprintf buffer=[%.*s]\n", buffer_len, buffer);
 	if (buffer_len > 0) {
 		BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+		logging_stats_log();
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+		// Keep a copy that survives a panic or watchdog reset, of the text or else the record
+#if LOGGING_BINARY
+		if (text) {
+			crash_tail_text(buffer, strlen(buffer));
+		} else {
+			crash_tail_record(tag, record, record_len);
+		}
+#else
+		crash_tail_text(buffer, strlen(buffer));
+#endif
+#endif
+		// A log that doesn't fit into a buffer is dropped and counted, see net_logging_get_stats()
+#if CONFIG_NET_LOGGING_PRIORITY_LANE
+		bool priority = (level == ESP_LOG_ERROR || level == ESP_LOG_WARN);
+#else
+		bool priority = false;
+#endif
+		// Each handle is read once, a sink that fails to start sets it back to NULL
+		atomic_fetch_add(&logging_writers, 1);
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 		// Send RingBuffer
-		BaseType_t sended;
-		if (xRingBufferUDP != NULL) {
-			sended = xRingbufferSendFromISR(xRingBufferUDP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == pdTRUE);
-		}
-		if (xRingBufferTCP != NULL) {
-			sended = xRingbufferSendFromISR(xRingBufferTCP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == pdTRUE);
-		}
-		if (xRingBufferMQTT != NULL) {
-			sended = xRingbufferSendFromISR(xRingBufferMQTT, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == pdTRUE);
-		}
-		if (xRingBufferHTTP != NULL) {
-			sended = xRingbufferSendFromISR(xRingBufferHTTP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == pdTRUE);
-		}
-		if (xRingBufferSSE != NULL) {
-			sended = xRingbufferSendFromISR(xRingBufferSSE, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == pdTRUE);
-		}
+		RingbufHandle_t udp = __atomic_load_n(&xRingBufferUDP, __ATOMIC_SEQ_CST);
+		RingbufHandle_t tcp = __atomic_load_n(&xRingBufferTCP, __ATOMIC_SEQ_CST);
+		RingbufHandle_t mqtt = __atomic_load_n(&xRingBufferMQTT, __ATOMIC_SEQ_CST);
+		RingbufHandle_t http = __atomic_load_n(&xRingBufferHTTP, __ATOMIC_SEQ_CST);
+		RingbufHandle_t sse = __atomic_load_n(&xRingBufferSSE, __ATOMIC_SEQ_CST);
+		RingbufHandle_t file = __atomic_load_n(&xRingBufferFILE, __ATOMIC_SEQ_CST);
 #else
 		// Send MessageBuffer
-		size_t sended;
-		if (xMessageBufferUDP != NULL) {
-			sended = xMessageBufferSendFromISR(xMessageBufferUDP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == strlen(buffer));
-		}
-		if (xMessageBufferTCP != NULL) {
-			sended = xMessageBufferSendFromISR(xMessageBufferTCP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == strlen(buffer));
-		}
-		if (xMessageBufferMQTT != NULL) {
-			sended = xMessageBufferSendFromISR(xMessageBufferMQTT, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == strlen(buffer));
-		}
-		if (xMessageBufferHTTP != NULL) {
-			sended = xMessageBufferSendFromISR(xMessageBufferHTTP, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == strlen(buffer));
-		}
-		if (xMessageBufferSSE != NULL) {
-			sended = xMessageBufferSendFromISR(xMessageBufferSSE, &buffer, strlen(buffer), &xHigherPriorityTaskWoken);
-			assert(sended == strlen(buffer));
-		}
+		MessageBufferHandle_t udp = __atomic_load_n(&xMessageBufferUDP, __ATOMIC_SEQ_CST);
+		MessageBufferHandle_t tcp = __atomic_load_n(&xMessageBufferTCP, __ATOMIC_SEQ_CST);
+		MessageBufferHandle_t mqtt = __atomic_load_n(&xMessageBufferMQTT, __ATOMIC_SEQ_CST);
+		MessageBufferHandle_t http = __atomic_load_n(&xMessageBufferHTTP, __ATOMIC_SEQ_CST);
+		MessageBufferHandle_t sse = __atomic_load_n(&xMessageBufferSSE, __ATOMIC_SEQ_CST);
+		MessageBufferHandle_t file = __atomic_load_n(&xMessageBufferFILE, __ATOMIC_SEQ_CST);
 #endif
+		if (udp != NULL && (wanted & (1 << NET_LOGGING_UDP))) logging_send(NET_LOGGING_UDP, udp, UDP_DATA, UDP_LEN, priority, &xHigherPriorityTaskWoken);
+		if (tcp != NULL && (wanted & (1 << NET_LOGGING_TCP))) logging_send(NET_LOGGING_TCP, tcp, TCP_DATA, TCP_LEN, priority, &xHigherPriorityTaskWoken);
+		if (mqtt != NULL && (wanted & (1 << NET_LOGGING_MQTT))) logging_send(NET_LOGGING_MQTT, mqtt, MQTT_DATA, MQTT_LEN, priority, &xHigherPriorityTaskWoken);
+		if (http != NULL && (wanted & (1 << NET_LOGGING_HTTP))) logging_send(NET_LOGGING_HTTP, http, &buffer, strlen(buffer), priority, &xHigherPriorityTaskWoken);
+		if (sse != NULL && (wanted & (1 << NET_LOGGING_SSE))) logging_send(NET_LOGGING_SSE, sse, &buffer, strlen(buffer), priority, &xHigherPriorityTaskWoken);
+		if (file != NULL && (wanted & (1 << NET_LOGGING_FILE))) logging_send(NET_LOGGING_FILE, file, FILE_DATA, FILE_LEN, priority, &xHigherPriorityTaskWoken);
+		atomic_fetch_sub(&logging_writers, 1);
 	}
 
 	// Write to stdout
-	if (writeToStdout) {
+	if (toStdout) {
 		return vprintf( fmt, l );
 	} else {
 		return 0;
 	}
 }
 
+// Call when SNTP has set or corrected the clock, e.g. from the callback of sntp_set_time_sync_notification_cb().
+// Binary records are stamped with esp_timer, and receivers are sent the difference to UTC taken here.
+void net_logging_time_sync(void) {
+	log_record_time_sync();
+}
+
+// Sink tasks that can send a log from another task while they are parked, see logging_flusher()
+static bool (*logging_flushers[NET_LOGGING_SINKS])(const void *data, size_t len);
+static void (*logging_finishers[NET_LOGGING_SINKS])(void);
+static TaskHandle_t logging_flush_tasks[NET_LOGGING_SINKS];
+// Sinks whose task is connected, see logging_ready() and logging_retry()
+static volatile bool logging_online[NET_LOGGING_SINKS];
+static SemaphoreHandle_t logging_flush_lock;
+
+// Called by a sink task before it takes its first log. send() is called by net_logging_flush() while the task is parked,
+// it sends one log the way the task does and returns false when it could not.
+// finish() is called after the queued logs, for a sink that holds logs of its own, e.g. a batch. NULL when there are none.
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void)) {
+	logging_flush_tasks[sink] = xTaskGetCurrentTaskHandle();
+	logging_finishers[sink] = finish;
+	logging_flushers[sink] = send;
+}
+
+// Park the task of a sink, so that its connection can be used by the caller. Returns false when it didn't park in time.
+static bool logging_park_wait(int sink, TickType_t xTicksToWait) {
+	taskENTER_CRITICAL(&logging_park_lock);
+	logging_park_state[sink] = LOGGING_PARK;
+	taskEXIT_CRITICAL(&logging_park_lock);
+	// Wake up the task when it waits for a log. When the buffer is full, it isn't waiting.
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+	xRingbufferSend(*logging_buffers[sink], "", LOGGING_DOORBELL_LEN, 0);
+#else
+	xMessageBufferSend(*logging_buffers[sink], "", LOGGING_DOORBELL_LEN, 0);
+#endif
+	if (xSemaphoreTake(logging_parked, xTicksToWait) == pdTRUE) return true;
+	// The task may have parked just now
+	taskENTER_CRITICAL(&logging_park_lock);
+	bool parked = (logging_park_state[sink] == LOGGING_PARKED);
+	if (!parked) logging_park_state[sink] = LOGGING_RUN;
+	taskEXIT_CRITICAL(&logging_park_lock);
+	if (parked) xSemaphoreTake(logging_parked, portMAX_DELAY);
+	return parked;
+}
+
+// Let the task of a parked sink go on
+static void logging_unpark(int sink) {
+	taskENTER_CRITICAL(&logging_park_lock);
+	logging_park_state[sink] = LOGGING_RUN;
+	taskEXIT_CRITICAL(&logging_park_lock);
+	xTaskNotifyGive(logging_flush_tasks[sink]);
+}
+
+// Send the queued logs of the UDP, TCP, MQTT, HTTP and FILE sinks from the calling task, until they are sent or xTicksToWait has passed.
+// Each sink task is parked between two logs, and the caller sends on its connection, so the time taken doesn't depend on when the sink tasks run.
+// Sinks that are not connected are skipped, their logs stay queued. SSE sends its logs from its own task, when the clients ask.
+// Must be called from a task while the scheduler runs, returns ESP_ERR_INVALID_STATE from an ISR or with the scheduler suspended.
+esp_err_t net_logging_flush(TickType_t xTicksToWait) {
+	if (xPortInIsrContext() || xTaskGetSchedulerState() != taskSCHEDULER_RUNNING) return ESP_ERR_INVALID_STATE;
+	if (logging_flush_lock == NULL) return ESP_OK;
+	TickType_t start = xTaskGetTickCount();
+	if (xSemaphoreTake(logging_flush_lock, xTicksToWait) != pdTRUE) return ESP_ERR_TIMEOUT;
+	esp_err_t ret = ESP_OK;
+	for (int sink = 0; sink < NET_LOGGING_SINKS; sink++) {
+		if (logging_flushers[sink] == NULL || *logging_buffers[sink] == NULL || !logging_online[sink]) continue;
+		// A log of the sink task itself must not wait for that task
+		if (logging_flush_tasks[sink] == xTaskGetCurrentTaskHandle()) continue;
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= xTicksToWait || !logging_park_wait(sink, xTicksToWait - elapsed)) {
+			ret = ESP_ERR_TIMEOUT;
+			break;
+		}
+		while (xTaskGetTickCount() - start < xTicksToWait) {
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+			size_t received;
+			RingbufHandle_t from;
+			void *buffer = logging_take(sink, &received, 0, &from, false);
+			if (buffer == NULL) break;
+#else
+			char buffer[xItemSize];
+			size_t received = logging_take(sink, buffer, sizeof(buffer), 0, false);
+			if (received == 0) break;
+#endif
+			int64_t sent = esp_timer_get_time();
+			bool ok = logging_flushers[sink](buffer, received);
+			if (ok) {
+				logging_stats_sent(sink, 1, received, sent);
+			} else {
+				logging_stats_dropped(sink, 1);
+			}
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+			vRingbufferReturnItem(from, buffer);
+#endif
+			// The connection is lost, the sink task connects again and sends the rest
+			if (!ok) break;
+		}
+		if (logging_finishers[sink] != NULL) logging_finishers[sink]();
+		logging_unpark(sink);
+	}
+	xSemaphoreGive(logging_flush_lock);
+	return ret;
+}
+
+#if CONFIG_NET_LOGGING_FLUSH_ON_RESTART
+// Called by esp_restart()
+static void logging_shutdown(void) {
+	net_logging_flush(pdMS_TO_TICKS(CONFIG_NET_LOGGING_FLUSH_TIMEOUT));
+}
+#endif
+
+#if CONFIG_NET_LOGGING_RATE_LIMIT || CONFIG_NET_LOGGING_SHED
+// The reports of the rate limits and of the load shedding are logs themselves.
+// Their timers run in the esp_timer task, which only leaves them for this task to log.
+static TaskHandle_t logging_reporter;
+
+// Called by the timers when a report is due
+void logging_report(void) {
+	if (logging_reporter != NULL) xTaskNotifyGive(logging_reporter);
+}
+
+static void logging_report_task(void *pvParameters) {
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+		logging_limit_report();
+#endif
+#if CONFIG_NET_LOGGING_SHED
+		logging_shed_report();
+#endif
+	}
+}
+#endif
+
+// Done once, by the first *_logging_init()
+static void logging_start(void) {
+	static bool started = false;
+	if (started) return;
+	started = true;
+	logging_parked = xSemaphoreCreateBinary();
+	configASSERT( logging_parked );
+	logging_flush_lock = xSemaphoreCreateMutex();
+	configASSERT( logging_flush_lock );
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+	// Take the logs of a crashed previous boot before the logs of this boot replace them
+	crash_tail_init();
+#endif
+#if CONFIG_NET_LOGGING_FLUSH_ON_RESTART
+	esp_register_shutdown_handler(logging_shutdown);
+#endif
+#if CONFIG_NET_LOGGING_RATE_LIMIT || CONFIG_NET_LOGGING_SHED
+	xTaskCreate(logging_report_task, "LOGS_REPORT", 1024*3, NULL, 2, &logging_reporter);
+#endif
+#if CONFIG_NET_LOGGING_RATE_LIMIT
+	logging_limit_start();
+#endif
+#if CONFIG_NET_LOGGING_DEDUP
+	logging_dedup_start();
+#endif
+#if CONFIG_NET_LOGGING_SHED
+	logging_shed_start();
+#endif
+}
+
+// Sinks whose task has been able to send, see logging_ready()
+static bool logging_started[NET_LOGGING_SINKS];
+
+// Set up a sink before its task starts: its priority lane, and a task that has not been ready yet
+static void logging_sink_create(int sink) {
+	logging_started[sink] = false;
+	logging_online[sink] = false;
+	logging_flushers[sink] = NULL;
+	logging_finishers[sink] = NULL;
+	logging_flush_tasks[sink] = NULL;
+#if CONFIG_NET_LOGGING_PRIORITY_LANE
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+	RingbufHandle_t high = xRingbufferCreate(CONFIG_NET_LOGGING_PRIORITY_SIZE, RINGBUF_TYPE_NOSPLIT);
+#else
+	MessageBufferHandle_t high = xMessageBufferCreate(CONFIG_NET_LOGGING_PRIORITY_SIZE);
+#endif
+	configASSERT( high );
+	__atomic_store_n(&logging_high[sink], high, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Delete a buffer nobody uses any more. Returns the number of logs that were left in it.
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static uint32_t logging_delete(RingbufHandle_t buffer) {
+	if (buffer == NULL) return 0;
+	uint32_t records = 0;
+	size_t received;
+	void *item;
+	while ((item = xRingbufferReceive(buffer, &received, 0)) != NULL) {
+		if (received != LOGGING_DOORBELL_LEN || *(uint8_t *)item != 0) records++;
+		vRingbufferReturnItem(buffer, item);
+	}
+	vRingbufferDelete(buffer);
+	return records;
+}
+#else
+static uint32_t logging_delete(MessageBufferHandle_t buffer) {
+	if (buffer == NULL) return 0;
+	uint32_t records = 0;
+	char item[xItemSize];
+	size_t received;
+	while ((received = xMessageBufferReceive(buffer, item, sizeof(item), 0)) > 0) {
+		if (received != LOGGING_DOORBELL_LEN || item[0] != 0) records++;
+	}
+	vMessageBufferDelete(buffer);
+	return records;
+}
+#endif
+
+// Take the buffers away from a sink that has failed to start.
+// logging_vprintf() may be sending to them from another task, so they are deleted only once those calls have returned.
+// The logs left in them are counted as dropped.
+static void logging_remove(int sink) {
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+	RingbufHandle_t buffer = *logging_buffers[sink];
+	RingbufHandle_t high = logging_high[sink];
+#else
+	MessageBufferHandle_t buffer = *logging_buffers[sink];
+	MessageBufferHandle_t high = logging_high[sink];
+#endif
+	__atomic_store_n(logging_buffers[sink], NULL, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&logging_high[sink], NULL, __ATOMIC_SEQ_CST);
+	TickType_t start = xTaskGetTickCount();
+	while (atomic_load(&logging_writers) != 0) {
+		if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(100)) {
+			// Logs keep coming, leave the buffers rather than delete them under a writer
+			printf("logging buffer is not deleted\n");
+			return;
+		}
+		vTaskDelay(1);
+	}
+	uint32_t records = logging_delete(buffer);
+	records += logging_delete(high);
+	logging_stats_dropped(sink, records);
+}
+
+// Send the logs recorded before a crash to a sink that has just started
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+static void logging_replay(RingbufHandle_t xRingBuffer, bool binary) {
+#else
+static void logging_replay(MessageBufferHandle_t xMessageBuffer, bool binary) {
+#endif
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+	const char *reason = crash_tail_reason_get();
+	if (reason == NULL) return;
+
+	char line[xItemSize];
+	uint8_t record[xItemSize];
+	snprintf(line, sizeof(line), "---- previous boot, until the %s ----\n", reason);
+	size_t pos = 0;
+	bool done = false;
+	while (1) {
+		const void *data = line;
+		size_t data_len = strlen(line);
+		if (binary) {
+			data_len = log_record_encode_text(record, sizeof(record), line);
+			data = record;
+		}
+		// The sink task is running, so wait for room instead of dropping
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+		xRingbufferSend(xRingBuffer, data, data_len, pdMS_TO_TICKS(100));
+#else
+		xMessageBufferSend(xMessageBuffer, data, data_len, pdMS_TO_TICKS(100));
+#endif
+		if (done) break;
+		// One log at a time, the records turned back into text
+		if (!crash_tail_line(&pos, line, sizeof(line))) {
+			snprintf(line, sizeof(line), "---- end of previous boot ----\n");
+			done = true;
+		}
+	}
+#endif
+}
+
+#ifndef CONFIG_NET_LOGGING_RETRY_MAX
+#define CONFIG_NET_LOGGING_RETRY_MAX 30
+#endif
+
+#if CONFIG_NET_LOGGING_ASYNC_START && CONFIG_NET_LOGGING_CRASH_TAIL
+// The sink task is already taking logs, so the replay needs a task of its own to wait for room
+static void logging_replay_task(void *pvParameters) {
+	int sink = (intptr_t)pvParameters;
+#if CONFIG_NET_LOGGING_USE_RINGBUFFER
+	RingbufHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+#else
+	MessageBufferHandle_t buffer = __atomic_load_n(logging_buffers[sink], __ATOMIC_SEQ_CST);
+#endif
+	if (buffer != NULL) logging_replay(buffer, logging_binary[sink]);
+	vTaskDelete(NULL);
+}
+#endif
+
+// Called by *_logging_init() after it has started the sink task.
+// With NET_LOGGING_ASYNC_START, the task connects in the background and the logs wait in the buffer until then.
+// Otherwise wait until the task can send, and take the buffer away when it can't within a second.
+// Returns false when the sink has been given up. The task parameters are static, as the task may read them after this returns.
+static bool logging_wait(int sink) {
+#if CONFIG_NET_LOGGING_ASYNC_START
+	printf("%s logging starts in the background\n", logging_sink_name(sink));
+	return true;
+#else
+	// Wait for ready to receive notify
+	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
+	printf("%s ulTaskNotifyTake=%"PRIi32"\n", logging_sink_name(sink), value);
+	if (value == 0) {
+		printf("stop %s logging\n", logging_sink_name(sink));
+		logging_remove(sink);
+		return false;
+	}
+	// The logs of a crashed previous boot go first
+	logging_replay(*logging_buffers[sink], logging_binary[sink]);
+	return true;
+#endif
+}
+
+// Called by a sink task whenever it has reached its server, only the first call starts the sink.
+void logging_ready(int sink, TaskHandle_t taskHandle) {
+	logging_online[sink] = true;
+	if (logging_started[sink]) return;
+	logging_started[sink] = true;
+#if CONFIG_NET_LOGGING_ASYNC_START
+	printf("%s logging is ready\n", logging_sink_name(sink));
+#if CONFIG_NET_LOGGING_CRASH_TAIL
+	xTaskCreate(logging_replay_task, "REPLAY", 1024*4, (void *)(intptr_t)sink, 2, NULL);
+#endif
+#else
+	// Send ready to receive notify
+	xTaskNotifyGive(taskHandle);
+#endif
+}
+
+// Called by a sink task that could not reach its server. Waits 1, 2, 4 ... up to NET_LOGGING_RETRY_MAX seconds
+// and returns true to try again. Reset *attempt to 0 once the server has been reached.
+// Without NET_LOGGING_ASYNC_START, a sink that has never been ready returns false at once, *_logging_init() has given up on it.
+bool logging_retry(int sink, int *attempt) {
+	logging_online[sink] = false;
+#if !CONFIG_NET_LOGGING_ASYNC_START
+	if (!logging_started[sink]) return false;
+#endif
+	uint32_t seconds = CONFIG_NET_LOGGING_RETRY_MAX;
+	if (*attempt < 16 && (1 << *attempt) < seconds) seconds = 1 << *attempt;
+	(*attempt)++;
+	printf("%s logging tries again in %"PRIu32"s\n", logging_sink_name(sink), seconds);
+	vTaskDelay(pdMS_TO_TICKS(seconds * 1000));
+	return true;
+}
+
+// Called by a sink task that can't run any more, e.g. when its port is taken, before it deletes itself
+void logging_failed(int sink) {
+#if !CONFIG_NET_LOGGING_ASYNC_START
+	// *_logging_init() takes the buffer away from a sink that has never been ready
+	if (!logging_started[sink]) return;
+#endif
+	printf("stop %s logging\n", logging_sink_name(sink));
+	logging_remove(sink);
+}
+
 void udp_client(void *pvParameters);
 
 esp_err_t udp_logging_init(const char *ipaddr, unsigned long port, int16_t enableStdout) {
 
+	logging_start();
+
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 	printf("start udp logging(xRingBuffer): ipaddr=[%s] port=%ld\n", ipaddr, port);
 	// Create RineBuffer
@@ -128,27 +872,16 @@ esp_err_t udp_logging_init(const char *ipaddr, unsigned long port, int16_t enabl
 	xMessageBufferUDP = xMessageBufferCreate(xBufferSizeBytes);
 	configASSERT( xMessageBufferUDP );
 #endif
+	logging_sink_create(NET_LOGGING_UDP);
 
 	// Start UDP task
-	PARAMETER_t param;
+	static PARAMETER_t param;
 	param.port = port;
 	strcpy(param.ipv4, ipaddr);
 	param.taskHandle = xTaskGetCurrentTaskHandle();
 	xTaskCreate(udp_client, "UDP", 1024*6, (void *)&param, 2, NULL);
 
-	// Wait for ready to receive notify
-	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
-	printf("udp ulTaskNotifyTake=%"PRIi32"\n", value);
-	if (value == 0) {
-		printf("stop udp logging\n");
-#if CONFIG_NET_LOGGING_USE_RINGBUFFER
-		vRingbufferDelete(xRingBufferUDP);
-		xRingBufferUDP = NULL;
-#else
-		vMessageBufferDelete(xMessageBufferUDP);
-		xMessageBufferUDP = NULL;
-#endif
-	}
+	logging_wait(NET_LOGGING_UDP);
 
 	// Set function used to output log entries.
 	writeToStdout = enableStdout;
@@ -160,6 +893,8 @@ void tcp_client(void *pvParameters);
 
 esp_err_t tcp_logging_init(const char *ipaddr, unsigned long port, int16_t enableStdout) {
 
+	logging_start();
+
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 	printf("start tcp logging(xRingBuffer): ipaddr=[%s] port=%ld\n", ipaddr, port);
 	// Create RineBuffer
@@ -171,27 +906,16 @@ esp_err_t tcp_logging_init(const char *ipaddr, unsigned long port, int16_t enabl
 	xMessageBufferTCP = xMessageBufferCreate(xBufferSizeBytes);
 	configASSERT( xMessageBufferTCP );
 #endif
+	logging_sink_create(NET_LOGGING_TCP);
 
 	// Start TCP task
-	PARAMETER_t param;
+	static PARAMETER_t param;
 	param.port = port;
 	strcpy(param.ipv4, ipaddr);
 	param.taskHandle = xTaskGetCurrentTaskHandle();
 	xTaskCreate(tcp_client, "TCP", 1024*6, (void *)&param, 2, NULL);
 
-	// Wait for ready to receive notify
-	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
-	printf("tcp ulTaskNotifyTake=%"PRIi32"\n", value);
-	if (value == 0) {
-		printf("stop tcp logging\n");
-#if CONFIG_NET_LOGGING_USE_RINGBUFFER
-		vRingbufferDelete(xRingBufferTCP);
-		xRingBufferTCP = NULL;
-#else
-		vMessageBufferDelete(xMessageBufferTCP);
-		xMessageBufferTCP = NULL;
-#endif
-	}
+	logging_wait(NET_LOGGING_TCP);
 
 	// Set function used to output log entries.
 	writeToStdout = enableStdout;
@@ -203,6 +927,8 @@ void sse_server(void *pvParameters);
 
 esp_err_t sse_logging_init(unsigned long port, int16_t enableStdout) {
 
+	logging_start();
+
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 	printf("start HTTP Server Sent Events logging(xRingBuffer): SSE server listening on port=%ld\n", port);
 	// Create RineBuffer
@@ -214,26 +940,15 @@ esp_err_t sse_logging_init(unsigned long port, int16_t enableStdout) {
 	xMessageBufferSSE = xMessageBufferCreate(xBufferSizeBytes);
 	configASSERT( xMessageBufferSSE );
 #endif
+	logging_sink_create(NET_LOGGING_SSE);
 
 	// Start SSE Server
-	PARAMETER_t param;
+	static PARAMETER_t param;
 	param.port = port;
 	param.taskHandle = xTaskGetCurrentTaskHandle();
 	xTaskCreate(sse_server, "HTTP SSE", 1024*6, (void *)&param, 2, NULL);
 
-	// Wait for ready to receive notify
-	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
-	printf("sse ulTaskNotifyTake=%"PRIi32"\n", value);
-	if (value == 0) {
-		printf("stop HTTP SSE logging\n");
-#if CONFIG_NET_LOGGING_USE_RINGBUFFER
-		vRingbufferDelete(xRingBufferSSE);
-		xRingBufferSSE = NULL;
-#else
-		vMessageBufferDelete(xMessageBufferSSE);
-		xMessageBufferSSE = NULL;
-#endif
-	}
+	logging_wait(NET_LOGGING_SSE);
 
 	// Set function used to output log entries.
 	writeToStdout = enableStdout;
@@ -245,6 +960,8 @@ void mqtt_pub(void *pvParameters);
 
 esp_err_t mqtt_logging_init(const char *url, char *topic, int16_t enableStdout) {
 
+	logging_start();
+
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 	printf("start mqtt logging(xRingBuffer): url=[%s] topic=[%s]\n", url, topic);
 	// Create RineBuffer
@@ -256,27 +973,16 @@ esp_err_t mqtt_logging_init(const char *url, char *topic, int16_t enableStdout)
 	xMessageBufferMQTT = xMessageBufferCreate(xBufferSizeBytes);
 	configASSERT( xMessageBufferMQTT );
 #endif
+	logging_sink_create(NET_LOGGING_MQTT);
 
 	// Start MQTT task
-	PARAMETER_t param;
+	static PARAMETER_t param;
 	strcpy(param.url, url);
 	strcpy(param.topic, topic);
 	param.taskHandle = xTaskGetCurrentTaskHandle();
 	xTaskCreate(mqtt_pub, "MQTT", 1024*6, (void *)&param, 2, NULL);
 
-	// Wait for ready to receive notify
-	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
-	printf("mqtt ulTaskNotifyTake=%"PRIi32"\n", value);
-	if (value == 0) {
-		printf("stop mqtt logging\n");
-#if CONFIG_NET_LOGGING_USE_RINGBUFFER
-		vRingbufferDelete(xRingBufferMQTT);
-		xRingBufferMQTT = NULL;
-#else
-		vMessageBufferDelete(xMessageBufferMQTT);
-		xMessageBufferMQTT = NULL;
-#endif
-	}
+	logging_wait(NET_LOGGING_MQTT);
 
 	// Set function used to output log entries.
 	writeToStdout = enableStdout;
@@ -288,6 +994,8 @@ void http_client(void *pvParameters);
 
 esp_err_t http_logging_init(const char *url, int16_t enableStdout) {
 
+	logging_start();
+
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 	printf("start http logging(xRingBuffer): url=[%s]\n", url);
 	// Create RineBuffer
@@ -299,24 +1007,52 @@ esp_err_t http_logging_init(const char *url, int16_t enableStdout) {
 	xMessageBufferHTTP = xMessageBufferCreate(xBufferSizeBytes);
 	configASSERT( xMessageBufferHTTP );
 #endif
+	logging_sink_create(NET_LOGGING_HTTP);
 
 	// Start HTTP task
-	PARAMETER_t param;
+	static PARAMETER_t param;
 	strcpy(param.url, url);
 	param.taskHandle = xTaskGetCurrentTaskHandle();
-	xTaskCreate(http_client, "HTTP", 1024*4, (void *)&param, 2, NULL);
+	xTaskCreate(http_client, "HTTP", 1024*6, (void *)&param, 2, NULL);
+
+	logging_wait(NET_LOGGING_HTTP);
+
+	// Set function used to output log entries.
+	writeToStdout = enableStdout;
+	esp_log_set_vprintf(logging_vprintf);
+	return ESP_OK;
+}
+
+void file_writer(void *pvParameters);
+void file_uploader(void *pvParameters);
+
+esp_err_t file_logging_init(const char *path, int16_t enableStdout) {
+
+	logging_start();
 
-	// Wait for ready to receive notify
-	uint32_t value = ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(1000) );
-	printf("http ulTaskNotifyTake=%"PRIi32"\n", value);
-	if (value == 0) {
-		printf("stop http logging\n");
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-		vRingbufferDelete(xRingBufferHTTP);
-		xRingBufferHTTP = NULL;
+	printf("start file logging(xRingBuffer): path=[%s]\n", path);
+	// Create RineBuffer
+	xRingBufferFILE = xRingbufferCreate(xBufferSizeBytes, RINGBUF_TYPE_NOSPLIT);
+	configASSERT( xRingBufferFILE );
 #else
-		vMessageBufferDelete(xMessageBufferHTTP);
-		xMessageBufferHTTP = NULL;
+	printf("start file logging(xMessageBuffer): path=[%s]\n", path);
+	// Create MessageBuffer
+	xMessageBufferFILE = xMessageBufferCreate(xBufferSizeBytes);
+	configASSERT( xMessageBufferFILE );
+#endif
+	logging_sink_create(NET_LOGGING_FILE);
+
+	// Start file task
+	static PARAMETER_t param;
+	strcpy(param.path, path);
+	param.taskHandle = xTaskGetCurrentTaskHandle();
+	xTaskCreate(file_writer, "FILE", 1024*4, (void *)&param, 2, NULL);
+
+	if (logging_wait(NET_LOGGING_FILE)) {
+#if CONFIG_LOG_FILE_UPLOAD
+		// Send the files to the server whenever it can be reached
+		xTaskCreate(file_uploader, "FILE UPLOAD", 1024*4, NULL, 2, NULL);
 #endif
 	}
 
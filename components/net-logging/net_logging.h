@@ -13,6 +13,7 @@ typedef struct {
 	char ipv4[20]; // xxx.xxx.xxx.xxx
 	char url[64]; // mqtt://iot.eclipse.org
 	char topic[64];
+	char path[64]; // /spiffs
 	TaskHandle_t taskHandle;
 } PARAMETER_t;
 
@@ -21,6 +22,31 @@ typedef struct {
 // The size, in bytes, required to hold each item in the message,
 #define xItemSize 256
 
+// Sinks, in the order of NET_LOGGING_STATS_t.sink
+enum { NET_LOGGING_UDP, NET_LOGGING_TCP, NET_LOGGING_MQTT, NET_LOGGING_HTTP, NET_LOGGING_SSE, NET_LOGGING_FILE, NET_LOGGING_SINKS };
+// Not a sink, but filtered like one, see net_logging_level_set()
+#define NET_LOGGING_STDOUT NET_LOGGING_SINKS
+
+// Send time buckets: <100us, <1ms, <10ms, <100ms, <1s and 1s or more
+#define NET_LOGGING_LATENCY_BUCKETS 6
+
+typedef struct {
+	uint32_t enqueued;       // logs put into the buffer of the sink
+	uint32_t enqueued_bytes;
+	uint32_t dropped;        // logs that didn't fit into the buffer, or that the sink could not send
+	uint32_t suppressed;     // logs over a rate limit, or left out by load shedding
+	uint32_t sent;           // logs sent by the sink task
+	uint32_t sent_bytes;
+	uint32_t high_water;     // most bytes in the buffer at one time, out of xBufferSizeBytes
+	uint32_t latency[NET_LOGGING_LATENCY_BUCKETS]; // sends, by the time from taking the logs out of the buffer until they were sent
+} NET_LOGGING_SINK_STATS_t;
+
+typedef struct {
+	int64_t timestamp;       // esp_timer_get_time() when the statistics were taken
+	uint32_t logs;           // logs made since boot that a sink wanted
+	NET_LOGGING_SINK_STATS_t sink[NET_LOGGING_SINKS];
+} NET_LOGGING_STATS_t;
+
 
 int logging_vprintf( const char *fmt, va_list l );
 esp_err_t udp_logging_init(const char *ipaddr, unsigned long port, int16_t enableStdout);
@@ -28,6 +54,13 @@ esp_err_t tcp_logging_init(const char *ipaddr, unsigned long port, int16_t enabl
 esp_err_t mqtt_logging_init(const char *url, char *topic, int16_t enableStdout);
 esp_err_t http_logging_init(const char *url, int16_t enableStdout);
 esp_err_t sse_logging_init(unsigned long port, int16_t enableStdout);
+esp_err_t file_logging_init(const char *path, int16_t enableStdout);
+esp_err_t net_logging_flush(TickType_t xTicksToWait);
+void net_logging_time_sync(void);
+void net_logging_get_stats(NET_LOGGING_STATS_t *stats);
+esp_err_t net_logging_level_set(int sink, const char *tag, esp_log_level_t level);
+esp_err_t net_logging_tag_rate_set(const char *tag, uint32_t rate, uint32_t burst);
+esp_err_t net_logging_sink_rate_set(int sink, uint32_t rate, uint32_t burst);
 
 #ifdef __cplusplus
 }
@@ -8,15 +8,19 @@
   CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include <ctype.h> // for toupper()
 #include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h> // for strncasecmp()
+#include <sys/uio.h> // for writev()
 #include <unistd.h> // for close()
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h" // for vTaskDelete()
-#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 #include "freertos/ringbuf.h"
@@ -27,29 +31,729 @@
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
+#if CONFIG_LOG_SSE_WEBSOCKET
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+#endif
 
 #include "net_logging.h"
 
-// File content buffer for sse.html
-extern const unsigned char sse_html_start[] asm("_binary_sse_html_start");
-extern const unsigned char sse_html_end[] asm("_binary_sse_html_end");
+// File content buffer for sse.html, gzipped at build time
+extern const unsigned char sse_html_gz_start[] asm("_binary_sse_html_gz_start");
+extern const unsigned char sse_html_gz_end[] asm("_binary_sse_html_gz_end");
+
+// Strong ETag of sse.html, the browser revalidates it with If-None-Match
+static char sse_html_etag[24];
+
+#ifndef CONFIG_LOG_SSE_MAX_CLIENTS
+#define CONFIG_LOG_SSE_MAX_CLIENTS 4
+#endif
+#ifndef CONFIG_LOG_SSE_HISTORY_SIZE
+#define CONFIG_LOG_SSE_HISTORY_SIZE 8192
+#endif
 
-#define STOP_SERVING_CLIENT	( 1 << 0 )
-#define STOPPED_SERVING_CLIENT	( 1 << 1 )
+// Idle time after which a comment is sent to an SSE client
+#define SSE_KEEPALIVE_MS 15000
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-extern RingbufHandle_t xRingBufferSSE;
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
 #else
-extern MessageBufferHandle_t xMessageBufferSSE;
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
+#endif
+
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+size_t logging_stats_json(char *buffer, size_t size);
+void logging_ready(int sink, TaskHandle_t taskHandle);
+void logging_failed(int sink);
+
+// Room for the JSON of /stats
+#define SSE_STATS_SIZE 2048
+
+// Logs are copied from xMessageBufferSSE into a ring shared by all clients.
+// Each client keeps its own cursor, so a slow client only loses its own data.
+// Every record gets a sequence number, sent as the SSE id, so that a reconnecting
+// browser can continue from the Last-Event-ID it has seen.
+// Level and tag are taken from the log line once, when it enters the ring,
+// so that client filters can skip records without looking at the text.
+typedef struct {
+  uint32_t seq;
+  uint16_t len;
+  char level;        // 'E', 'W', 'I', 'D', 'V' or 0 if unknown
+  uint32_t tag_hash;
+} SSE_RECORD_t;
+
+#define SSE_FILTER_TAGS 8
+#define SSE_LOST_UNKNOWN UINT32_MAX
+
+// Per client filter, parsed from the query string of /log-events
+typedef struct {
+  uint8_t level;                    // highest level to send, 0 for all
+  uint8_t tag_count;
+  uint32_t tags[SSE_FILTER_TAGS];   // hashes of the tags to send, none for all
+  char grep[32];                    // text that must appear in the line, empty for all
+} SSE_FILTER_t;
+
+typedef struct {
+  uint32_t seq;  // sequence number of the next record to send
+  size_t pos;    // offset of that record in the ring
+} SSE_CURSOR_t;
+
+static SemaphoreHandle_t sse_ring_lock;
+static uint8_t sse_ring[CONFIG_LOG_SSE_HISTORY_SIZE];
+static size_t sse_ring_head;       // offset where the next record is written
+static size_t sse_ring_tail;       // offset of the oldest record
+static size_t sse_ring_used;
+static uint32_t sse_ring_head_seq; // sequence number of the next record
+static uint32_t sse_ring_tail_seq; // sequence number of the oldest record
+
+static TaskHandle_t sse_clients[CONFIG_LOG_SSE_MAX_CLIENTS];
+
+static void sse_ring_write(size_t pos, const void *src, size_t len) {
+  size_t first = CONFIG_LOG_SSE_HISTORY_SIZE - pos;
+  if (first > len) first = len;
+  memcpy(&sse_ring[pos], src, first);
+  memcpy(&sse_ring[0], (const uint8_t *)src + first, len - first);
+}
+
+static void sse_ring_read(size_t pos, void *dst, size_t len) {
+  size_t first = CONFIG_LOG_SSE_HISTORY_SIZE - pos;
+  if (first > len) first = len;
+  memcpy(dst, &sse_ring[pos], first);
+  memcpy((uint8_t *)dst + first, &sse_ring[0], len - first);
+}
+
+static uint32_t sse_hash(const char *data, size_t len) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint8_t sse_level_rank(char level) {
+  const char *levels = "EWIDV";
+  const char *found = (level != 0) ? strchr(levels, level) : NULL;
+  return (found != NULL) ? found - levels + 1 : 0;
+}
+
+// Find level and tag of a log line like "\033[0;33mW (7060) wifi: ...".
+// Lines without them (e.g. the second half of a wifi log) keep those of the previous line.
+static void sse_parse_record(const char *data, size_t len, SSE_RECORD_t *record) {
+  static char last_level;
+  static uint32_t last_tag_hash;
+  const char *p = data;
+  const char *end = data + len;
+
+  // Skip color escape sequence
+  if (p < end && *p == '\033') {
+    while (p < end && *p != 'm') p++;
+    p++;
+  }
+  if (end - p > 4 && sse_level_rank(p[0]) != 0 && p[1] == ' ' && p[2] == '(') {
+    const char *tag = memchr(p, ')', end - p);
+    if (tag != NULL && tag + 2 < end) {
+      tag += 2;
+      const char *colon = memchr(tag, ':', end - tag);
+      if (colon != NULL) {
+        last_level = p[0];
+        last_tag_hash = sse_hash(tag, colon - tag);
+      }
+    }
+  }
+  record->level = last_level;
+  record->tag_hash = last_tag_hash;
+}
+
+static bool sse_filter_match(const SSE_FILTER_t *filter, const SSE_RECORD_t *record) {
+  if (filter->level != 0 && sse_level_rank(record->level) > filter->level) return false;
+  if (filter->tag_count == 0) return true;
+  for (int i = 0; i < filter->tag_count; i++) {
+    if (filter->tags[i] == record->tag_hash) return true;
+  }
+  return false;
+}
+
+static bool sse_filter_grep(const SSE_FILTER_t *filter, const char *data, size_t len) {
+  size_t grep_len = strlen(filter->grep);
+  if (grep_len == 0) return true;
+  for (size_t i = 0; i + grep_len <= len; i++) {
+    if (memcmp(&data[i], filter->grep, grep_len) == 0) return true;
+  }
+  return false;
+}
+
+// Decode a %xx / + escaped query value of length len into dst
+static void sse_url_decode(char *dst, size_t dst_size, const char *src, size_t len) {
+  size_t n = 0;
+  for (size_t i = 0; i < len && n + 1 < dst_size; i++) {
+    if (src[i] == '+') {
+      dst[n++] = ' ';
+    } else if (src[i] == '%' && i + 2 < len) {
+      char hex[3] = { src[i + 1], src[i + 2], 0 };
+      dst[n++] = (char)strtol(hex, NULL, 16);
+      i += 2;
+    } else {
+      dst[n++] = src[i];
+    }
+  }
+  dst[n] = 0;
+}
+
+// Parse "level=W&tag=wifi,MAIN&grep=text", ending at the first space
+static void sse_filter_parse(SSE_FILTER_t *filter, const char *query) {
+  memset(filter, 0, sizeof(*filter));
+  while (*query != 0 && *query != ' ') {
+    const char *end = query + strcspn(query, "& ");
+    const char *value = memchr(query, '=', end - query);
+    if (value != NULL) {
+      size_t name_len = value - query;
+      value++;
+      if (name_len == 5 && strncmp(query, "level", 5) == 0 && value < end) {
+        filter->level = sse_level_rank(toupper((unsigned char)*value));
+      } else if (name_len == 3 && strncmp(query, "tag", 3) == 0) {
+        while (value < end && filter->tag_count < SSE_FILTER_TAGS) {
+          char tag[32];
+          const char *comma = value + strcspn(value, ",& ");
+          if (comma > end) comma = end;
+          sse_url_decode(tag, sizeof(tag), value, comma - value);
+          filter->tags[filter->tag_count++] = sse_hash(tag, strlen(tag));
+          value = comma + 1;
+        }
+      } else if (name_len == 4 && strncmp(query, "grep", 4) == 0) {
+        sse_url_decode(filter->grep, sizeof(filter->grep), value, end - value);
+      }
+    }
+    query = (*end == '&') ? end + 1 : end;
+  }
+}
+
+// Append one record, dropping the oldest ones to make room
+static void sse_ring_put(const char *data, size_t len) {
+  SSE_RECORD_t record = { .len = len };
+  sse_parse_record(data, len, &record);
+  size_t need = sizeof(record) + len;
+
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  while (CONFIG_LOG_SSE_HISTORY_SIZE - sse_ring_used < need) {
+    SSE_RECORD_t oldest;
+    sse_ring_read(sse_ring_tail, &oldest, sizeof(oldest));
+    size_t oldest_size = sizeof(oldest) + oldest.len;
+    sse_ring_tail = (sse_ring_tail + oldest_size) % CONFIG_LOG_SSE_HISTORY_SIZE;
+    sse_ring_used -= oldest_size;
+    sse_ring_tail_seq++;
+  }
+  record.seq = sse_ring_head_seq++;
+  sse_ring_write(sse_ring_head, &record, sizeof(record));
+  sse_ring_write((sse_ring_head + sizeof(record)) % CONFIG_LOG_SSE_HISTORY_SIZE, data, len);
+  sse_ring_head = (sse_ring_head + need) % CONFIG_LOG_SSE_HISTORY_SIZE;
+  sse_ring_used += need;
+  xSemaphoreGive(sse_ring_lock);
+}
+
+// Position the cursor after the newest record
+static void sse_ring_cursor_init(SSE_CURSOR_t *cursor) {
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  cursor->seq = sse_ring_head_seq;
+  cursor->pos = sse_ring_head;
+  xSemaphoreGive(sse_ring_lock);
+}
+
+// Position the cursor after the record last_seq.
+// When that record is no longer in the ring, the next sse_ring_get() reports the loss.
+static void sse_ring_cursor_seek(SSE_CURSOR_t *cursor, uint32_t last_seq) {
+  uint32_t seq = last_seq + 1;
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  if (seq - sse_ring_tail_seq <= sse_ring_head_seq - sse_ring_tail_seq) {
+    cursor->seq = sse_ring_tail_seq;
+    cursor->pos = sse_ring_tail;
+    while (cursor->seq != seq) {
+      SSE_RECORD_t record;
+      sse_ring_read(cursor->pos, &record, sizeof(record));
+      cursor->pos = (cursor->pos + sizeof(record) + record.len) % CONFIG_LOG_SSE_HISTORY_SIZE;
+      cursor->seq++;
+    }
+  } else {
+    // The id is older than the ring, or newer than any record, e.g. from before a reboot.
+    // The cursor stays outside the ring, so that sse_ring_get() reports the loss.
+    cursor->seq = seq;
+    cursor->pos = ((int32_t)(seq - sse_ring_head_seq) > 0) ? sse_ring_head : sse_ring_tail;
+  }
+  xSemaphoreGive(sse_ring_lock);
+}
+
+// Copy the next record that passes filter into buffer, its header into *found, and advance the cursor.
+// Returns 0 when the client is up to date.
+// A cursor whose records have already been dropped jumps to the oldest record,
+// *lost is set to the number of records skipped that way, SSE_LOST_UNKNOWN if it can't be told (e.g. after a reboot).
+static size_t sse_ring_get(SSE_CURSOR_t *cursor, const SSE_FILTER_t *filter, char *buffer, size_t buffer_size, SSE_RECORD_t *found, uint32_t *lost) {
+  size_t len = 0;
+  *lost = 0;
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  if (cursor->seq - sse_ring_tail_seq > sse_ring_head_seq - sse_ring_tail_seq) {
+    *lost = sse_ring_tail_seq - cursor->seq;
+    if (*lost > INT32_MAX) *lost = SSE_LOST_UNKNOWN;
+    cursor->seq = sse_ring_tail_seq;
+    cursor->pos = sse_ring_tail;
+  }
+  while (len == 0 && cursor->seq != sse_ring_head_seq) {
+    SSE_RECORD_t record;
+    sse_ring_read(cursor->pos, &record, sizeof(record));
+    size_t payload = (cursor->pos + sizeof(record)) % CONFIG_LOG_SSE_HISTORY_SIZE;
+    cursor->pos = (cursor->pos + sizeof(record) + record.len) % CONFIG_LOG_SSE_HISTORY_SIZE;
+    cursor->seq++;
+    if (!sse_filter_match(filter, &record)) continue;
+
+    len = record.len < buffer_size ? record.len : buffer_size;
+    sse_ring_read(payload, buffer, len);
+    if (!sse_filter_grep(filter, buffer, len)) {
+      len = 0;
+      continue;
+    }
+    *found = record;
+  }
+  xSemaphoreGive(sse_ring_lock);
+  return len;
+}
+
+// Take a free client slot. Returns -1 when all slots are in use.
+static int sse_client_attach(void) {
+  int slot = -1;
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  for (int i = 0; i < CONFIG_LOG_SSE_MAX_CLIENTS; i++) {
+    if (sse_clients[i] == NULL) {
+      sse_clients[i] = xTaskGetCurrentTaskHandle();
+      slot = i;
+      break;
+    }
+  }
+  xSemaphoreGive(sse_ring_lock);
+  return slot;
+}
+
+static void sse_client_detach(int slot) {
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  sse_clients[slot] = NULL;
+  xSemaphoreGive(sse_ring_lock);
+}
+
+// SSE events are sent with writev().
+// The fixed parts of an event point at these strings, the payloads are copied out of the ring into the batch.
+static const char sse_log_line_prefix[] = "event: log-line\ndata: ";
+static const char sse_data_prefix[] = "\ndata: ";
+static const char sse_event_suffix[] = "\n\n";
+
+static const char sse_busy_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 16\r\n"
+  "Connection: close\r\n"
+  "\r\n"
+  "Too Many Clients";
+
+#define SSE_BATCH_IOV 64
+#define SSE_BATCH_DATA 1536
+// Room for a gap event and "id: 4294967295\n"
+#define SSE_EVENT_HEADER 48
+// iovecs needed by a single-line event plus a gap event in front of it
+#define SSE_EVENT_IOV 5
+
+typedef struct {
+  struct iovec iov[SSE_BATCH_IOV];
+  int iovcnt;
+  char data[SSE_BATCH_DATA];
+  size_t data_len;
+} SSE_BATCH_t;
+
+static void sse_batch_add(SSE_BATCH_t *batch, const void *base, size_t len) {
+  batch->iov[batch->iovcnt].iov_base = (void *)base;
+  batch->iov[batch->iovcnt].iov_len = len;
+  batch->iovcnt++;
+}
+
+// Append the decimal digits of value to dst, returns the number of characters
+static size_t sse_format_u32(char *dst, uint32_t value) {
+  char digits[10];
+  size_t len = 0;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  for (size_t i = 0; i < len; i++) dst[i] = digits[len - 1 - i];
+  return len;
+}
+
+// Copy text into the batch data area and send it as a separate iovec
+static char *sse_batch_text(SSE_BATCH_t *batch, const char *text, size_t len) {
+  char *dst = batch->data + batch->data_len;
+  memcpy(dst, text, len);
+  batch->data_len += len;
+  return dst;
+}
+
+static void sse_batch_add_gap(SSE_BATCH_t *batch, uint32_t lost) {
+  char *gap = sse_batch_text(batch, "event: gap\ndata: ", 17);
+  batch->data_len += sse_format_u32(batch->data + batch->data_len, lost);
+  sse_batch_text(batch, "\n\n", 2);
+  sse_batch_add(batch, gap, batch->data + batch->data_len - gap);
+}
+
+// Add one log record as an event, with a data line for each line of the payload
+static void sse_batch_add_event(SSE_BATCH_t *batch, uint32_t seq, char *payload, size_t len) {
+  // Remove trailing LF
+  while (len > 0 && (payload[len - 1] == '\n' || payload[len - 1] == '\r')) len--;
+
+  char *id = sse_batch_text(batch, "id: ", 4);
+  batch->data_len += sse_format_u32(batch->data + batch->data_len, seq);
+  sse_batch_text(batch, "\n", 1);
+  sse_batch_add(batch, id, batch->data + batch->data_len - id);
+  sse_batch_add(batch, sse_log_line_prefix, sizeof(sse_log_line_prefix) - 1);
+
+  char *line = payload;
+  char *end = payload + len;
+  char *lf;
+  while ((lf = memchr(line, '\n', end - line)) != NULL) {
+    if (batch->iovcnt + 4 > SSE_BATCH_IOV) {
+      // Out of iovecs, join the remaining lines with spaces
+      for (char *p = lf; p < end; p++) {
+        if (*p == '\n') *p = ' ';
+      }
+      break;
+    }
+    sse_batch_add(batch, line, lf - line);
+    sse_batch_add(batch, sse_data_prefix, sizeof(sse_data_prefix) - 1);
+    line = lf + 1;
+  }
+  sse_batch_add(batch, line, end - line);
+  sse_batch_add(batch, sse_event_suffix, sizeof(sse_event_suffix) - 1);
+}
+
+static esp_err_t sse_batch_send(int sock, SSE_BATCH_t *batch) {
+  size_t total = 0;
+  for (int i = 0; i < batch->iovcnt; i++) total += batch->iov[i].iov_len;
+  int ret = writev(sock, batch->iov, batch->iovcnt);
+  batch->iovcnt = 0;
+  batch->data_len = 0;
+  // A partial write would leave a broken event on the stream
+  return (ret == (int)total) ? ESP_OK : ESP_FAIL;
+}
+
+// Return the value of a request header, or NULL
+static const char *sse_find_header(const char *request, const char *name) {
+  size_t name_len = strlen(name);
+  const char *line = strstr(request, "\r\n");
+  while (line != NULL) {
+    line += 2;
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *value = line + name_len + 1;
+      while (*value == ' ') value++;
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+// Wake up every client, they block until there is something to send
+static void sse_client_notify_all(void) {
+  xSemaphoreTake(sse_ring_lock, portMAX_DELAY);
+  for (int i = 0; i < CONFIG_LOG_SSE_MAX_CLIENTS; i++) {
+    if (sse_clients[i] != NULL) xTaskNotifyGive(sse_clients[i]);
+  }
+  xSemaphoreGive(sse_ring_lock);
+}
+
+// Move logs from xMessageBufferSSE into the shared ring.
+// Everything already queued is moved before the clients are woken up.
+static void sse_dispatch(void *pvParameters) {
+  while (1) {
+    TickType_t xTicksToWait = portMAX_DELAY;
+    while (1) {
+      #if CONFIG_NET_LOGGING_USE_RINGBUFFER
+      size_t received = 0;
+      RingbufHandle_t from;
+      char *buffer = (char *)logging_receive(NET_LOGGING_SSE, &received, xTicksToWait, &from);
+      if (buffer == NULL) break;
+      #else
+      char buffer[xItemSize];
+      size_t received = logging_receive(NET_LOGGING_SSE, buffer, sizeof(buffer), xTicksToWait);
+      if (received == 0) break;
+      #endif
+
+      sse_ring_put(buffer, received);
+      // Each client sends at its own pace, so sent means put into the ring here
+      logging_stats_sent(NET_LOGGING_SSE, 1, received, 0);
+      #if CONFIG_NET_LOGGING_USE_RINGBUFFER
+      vRingbufferReturnItem(from, (void *)buffer);
+      #endif
+      xTicksToWait = 0;
+    }
+    sse_client_notify_all();
+  }
+}
+
+#if CONFIG_LOG_SSE_WEBSOCKET
+// WebSocket endpoint /log-ws, served on the same port and from the same ring as /log-events.
+// Several records are packed into one binary frame, each one as
+//   seq (4 bytes, little endian), length (2 bytes, little endian), level (1 byte), text
+// With /log-ws?format=text they are sent as a text frame of log lines instead.
+// Records lost by a slow client are reported with the text frame {"gap":N}.
+// The client can send these text messages at any time:
+//   "pause", "resume" and "filter level=W&tag=wifi,MAIN&grep=text"
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+// Header of a server frame, payloads are at most 65535 bytes
+#define WS_HEADER 4
+#define WS_RECORD_HEADER 7
+#define WS_FRAME_DATA 1536
+// Largest frame accepted from the client
+#define WS_CONTROL_SIZE 256
+
+typedef struct {
+  int sock;
+  bool text;     // send log lines as text frames instead of binary records
+  bool paused;
+  SSE_FILTER_t filter;
+  uint8_t rx[WS_CONTROL_SIZE];
+  size_t rx_len;
+} WS_CLIENT_t;
+
+// ws_watch() runs next to ws_serve() for as long as the connection is open
+typedef struct {
+  int sock;
+  TaskHandle_t client;  // the task of ws_serve()
+  TaskHandle_t task;
+  volatile bool closing;
+  SemaphoreHandle_t done;
+} WS_WATCH_t;
+
+// Wait until the client has sent something, and wake up ws_serve() to read it.
+// ws_serve() then sleeps until there are new logs or messages, instead of polling the socket.
+static void ws_watch(void *pvParameters) {
+  WS_WATCH_t *watch = pvParameters;
+  while (!watch->closing) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(watch->sock, &readfds);
+    select(watch->sock + 1, &readfds, NULL, NULL, NULL);
+    if (watch->closing) break;
+    xTaskNotifyGive(watch->client);
+    // The socket stays readable until ws_serve() has read it
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  xSemaphoreGive(watch->done);
+  vTaskDelete(NULL);
+}
+
+// Answer the opening handshake. Returns ESP_FAIL when it is not a valid upgrade request.
+static esp_err_t ws_handshake(int sock, const char *request) {
+  const char *key = sse_find_header(request, "Sec-WebSocket-Key");
+  if (key == NULL) return ESP_FAIL;
+  size_t key_len = strcspn(key, " \r\n");
+  if (key_len == 0 || key_len > 32) return ESP_FAIL;
+
+  // Sec-WebSocket-Accept is base64(sha1(key + GUID))
+  char key_guid[32 + sizeof(WS_GUID)];
+  memcpy(key_guid, key, key_len);
+  memcpy(key_guid + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+  unsigned char sha1[20];
+  mbedtls_sha1((const unsigned char *)key_guid, key_len + sizeof(WS_GUID) - 1, sha1);
+  unsigned char accept[32];
+  size_t accept_len;
+  mbedtls_base64_encode(accept, sizeof(accept), &accept_len, sha1, sizeof(sha1));
+
+  char headers[160];
+  int headers_len = snprintf(headers, sizeof(headers),
+           "HTTP/1.1 101 Switching Protocols\r\n"
+           "Upgrade: websocket\r\n"
+           "Connection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: %.*s\r\n"
+           "\r\n",
+           (int)accept_len, accept);
+  return (send(sock, headers, headers_len, 0) == headers_len) ? ESP_OK : ESP_FAIL;
+}
+
+// Send one frame with a single send().
+// payload must have WS_HEADER bytes of room in front of it for the frame header.
+static esp_err_t ws_send_frame(int sock, uint8_t opcode, uint8_t *payload, size_t len) {
+  uint8_t *header;
+  if (len < 126) {
+    header = payload - 2;
+    header[1] = len;
+  } else {
+    header = payload - 4;
+    header[1] = 126;
+    header[2] = len >> 8;
+    header[3] = len & 0xff;
+  }
+  header[0] = 0x80 | opcode;
+  int total = payload + len - header;
+  return (send(sock, header, total, 0) == total) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t ws_send_gap(int sock, uint32_t lost) {
+  uint8_t frame[WS_HEADER + 20];
+  char *text = (char *)frame + WS_HEADER;
+  memcpy(text, "{\"gap\":", 7);
+  size_t len = 7 + sse_format_u32(text + 7, lost);
+  text[len++] = '}';
+  return ws_send_frame(sock, WS_OP_TEXT, frame + WS_HEADER, len);
+}
+
+static void ws_control_message(WS_CLIENT_t *ws, const uint8_t *payload, size_t len) {
+  char message[WS_CONTROL_SIZE];
+  memcpy(message, payload, len);
+  message[len] = 0;
+  if (strcmp(message, "pause") == 0) {
+    ws->paused = true;
+  } else if (strcmp(message, "resume") == 0) {
+    ws->paused = false;
+  } else if (strncmp(message, "filter", 6) == 0 && (message[6] == ' ' || message[6] == 0)) {
+    sse_filter_parse(&ws->filter, (message[6] == ' ') ? &message[7] : "");
+  }
+}
+
+// Handle whatever the client has sent so far, without blocking.
+// Returns ESP_FAIL when the connection is to be closed.
+static esp_err_t ws_receive(WS_CLIENT_t *ws) {
+  int ret = recv(ws->sock, ws->rx + ws->rx_len, sizeof(ws->rx) - ws->rx_len, MSG_DONTWAIT);
+  if (ret == 0) return ESP_FAIL;
+  if (ret < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+  ws->rx_len += ret;
+
+  while (ws->rx_len >= 2) {
+    uint8_t opcode = ws->rx[0] & 0x0f;
+    size_t len = ws->rx[1] & 0x7f;
+    size_t header = 6;
+    // Client frames are always masked
+    if ((ws->rx[1] & 0x80) == 0 || len == 127) return ESP_FAIL;
+    if (len == 126) {
+      if (ws->rx_len < 4) break;
+      len = (ws->rx[2] << 8) | ws->rx[3];
+      header = 8;
+    }
+    if (header + len > sizeof(ws->rx) - 1) return ESP_FAIL;
+    if ((opcode & 0x8) != 0 && len > 125) return ESP_FAIL;
+    if (ws->rx_len < header + len) break;
+
+    uint8_t *mask = &ws->rx[header - 4];
+    uint8_t *payload = &ws->rx[header];
+    for (size_t i = 0; i < len; i++) payload[i] ^= mask[i % 4];
+
+    if (opcode == WS_OP_TEXT) {
+      ws_control_message(ws, payload, len);
+    } else if (opcode == WS_OP_PING || opcode == WS_OP_CLOSE) {
+      // Answer with the same payload, and end the connection after a close
+      uint8_t frame[WS_HEADER + 125];
+      memcpy(frame + WS_HEADER, payload, len);
+      uint8_t reply = (opcode == WS_OP_PING) ? WS_OP_PONG : WS_OP_CLOSE;
+      if (ws_send_frame(ws->sock, reply, frame + WS_HEADER, len) != ESP_OK) return ESP_FAIL;
+      if (opcode == WS_OP_CLOSE) return ESP_FAIL;
+    }
+    // Anything else, e.g. a pong, is ignored
+    ws->rx_len -= header + len;
+    memmove(ws->rx, ws->rx + header + len, ws->rx_len);
+  }
+  return ESP_OK;
+}
+
+// Stream the ring to a WebSocket client until it goes away
+static void ws_serve(int sock, const char *query) {
+  WS_CLIENT_t ws = { .sock = sock };
+  sse_filter_parse(&ws.filter, query);
+  const char *format = strstr(query, "format=text");
+  ws.text = (format != NULL && format < query + strcspn(query, " "));
+  uint8_t opcode = ws.text ? WS_OP_TEXT : WS_OP_BINARY;
+  size_t record_header = ws.text ? 0 : WS_RECORD_HEADER;
+
+  SSE_CURSOR_t cursor;
+  sse_ring_cursor_init(&cursor);
+
+  WS_WATCH_t watch = { .sock = sock, .client = xTaskGetCurrentTaskHandle() };
+  watch.done = xSemaphoreCreateBinary();
+  if (watch.done == NULL) return;
+  if (xTaskCreate(ws_watch, "LOGS_WS_WATCH", 1024*2, &watch, 2, &watch.task) != pdPASS) {
+    vSemaphoreDelete(watch.done);
+    return;
+  }
+
+  uint8_t frame[WS_HEADER + WS_FRAME_DATA];
+  uint8_t *data = frame + WS_HEADER;
+  const TickType_t keepalive = pdMS_TO_TICKS(SSE_KEEPALIVE_MS);
+  TickType_t last_send = xTaskGetTickCount();
+  while (ws_receive(&ws) == ESP_OK) {
+    // What the client sent has been read, ws_watch() waits for more
+    xTaskNotifyGive(watch.task);
+
+    // Pack as many records as fit into one frame
+    size_t data_len = 0;
+    esp_err_t ret = ESP_OK;
+    while (!ws.paused && WS_FRAME_DATA - data_len >= WS_RECORD_HEADER + xItemSize) {
+      uint8_t *packed = data + data_len;
+      SSE_RECORD_t record;
+      uint32_t lost;
+      size_t received = sse_ring_get(&cursor, &ws.filter, (char *)packed + record_header, xItemSize - 1, &record, &lost);
+      if (lost != 0) {
+        // Send the records before the gap first, then move this one to the front
+        if (data_len > 0) ret = ws_send_frame(sock, opcode, data, data_len);
+        if (ret == ESP_OK) ret = ws_send_gap(sock, (lost == SSE_LOST_UNKNOWN) ? 0 : lost);
+        if (ret != ESP_OK) break;
+        memmove(data, packed, record_header + received);
+        packed = data;
+        data_len = 0;
+      }
+      if (received == 0) break;
+
+      if (ws.text) {
+        // One line per record
+        char *line = (char *)packed;
+        while (received > 0 && (line[received - 1] == '\n' || line[received - 1] == '\r')) received--;
+        line[received++] = '\n';
+      } else {
+        packed[0] = record.seq & 0xff;
+        packed[1] = (record.seq >> 8) & 0xff;
+        packed[2] = (record.seq >> 16) & 0xff;
+        packed[3] = record.seq >> 24;
+        packed[4] = received & 0xff;
+        packed[5] = received >> 8;
+        packed[6] = record.level;
+      }
+      data_len += record_header + received;
+    }
+    if (ret != ESP_OK) break;
+
+    if (data_len > 0) {
+      if (ws_send_frame(sock, opcode, data, data_len) != ESP_OK) break;
+      last_send = xTaskGetTickCount();
+      continue;
+    }
+
+    // Sleep until the dispatcher has new logs or ws_watch() has seen a message
+    TickType_t idle = xTaskGetTickCount() - last_send;
+    if (ulTaskNotifyTake(pdTRUE, (idle < keepalive) ? keepalive - idle : 0) == 0 &&
+        xTaskGetTickCount() - last_send >= keepalive) {
+      // Nothing was logged for a while, a ping finds out if the client has gone away
+      if (ws_send_frame(sock, WS_OP_PING, data, 0) != ESP_OK) break;
+      last_send = xTaskGetTickCount();
+    }
+  }
+
+  // Shutting down the receiving side wakes up select(), the socket is closed once ws_watch() is gone
+  watch.closing = true;
+  shutdown(sock, SHUT_RD);
+  xTaskNotifyGive(watch.task);
+  xSemaphoreTake(watch.done, portMAX_DELAY);
+  vSemaphoreDelete(watch.done);
+}
 #endif
 
 void serve_client(void *pvParameters) {
-  void** params = (void**)pvParameters;
-  const int* client_sock_ptr = (int*)params[0];
-  int client_sock = *client_sock_ptr;
-  const EventGroupHandle_t* client_serving_task_events_ptr = (EventGroupHandle_t*)params[1];
-  EventGroupHandle_t client_serving_task_events = *client_serving_task_events_ptr;
-  const size_t sse_html_size = sse_html_end - sse_html_start;
+  int client_sock = (int)(intptr_t)pvParameters;
+  const size_t sse_html_size = sse_html_gz_end - sse_html_gz_start;
 
   // Receive HTTP request
   char request[1024];
@@ -65,67 +769,160 @@ void serve_client(void *pvParameters) {
   // Null-terminate received data
   request[req_len] = 0;
 
-  // Check if the request is for the root path (/)
-  if (strstr(request, "GET / HTTP") != NULL) {
-    // Prepare HTTP response
+  // Check if the request is for the root path (/), with or without a query string
+  if (strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /?", 6) == 0) {
     char headers[256];
-    snprintf(headers, sizeof(headers),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: text/html\r\n"
-             "Content-Length: %d\r\n"
-             "Connection: close\r\n"
-             "\r\n",
-             sse_html_size);
+    const char *if_none_match = sse_find_header(request, "If-None-Match");
+    const char *etag = (if_none_match != NULL) ? strstr(if_none_match, sse_html_etag) : NULL;
+    if (etag != NULL && etag < strstr(if_none_match, "\r\n")) {
+      // The browser already has this page
+      snprintf(headers, sizeof(headers),
+               "HTTP/1.1 304 Not Modified\r\n"
+               "ETag: %s\r\n"
+               "Cache-Control: no-cache\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               sse_html_etag);
+      send(client_sock, headers, strlen(headers), 0);
+    } else {
+      // Prepare HTTP response
+      int headers_len = snprintf(headers, sizeof(headers),
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: text/html; charset=utf-8\r\n"
+               "Content-Encoding: gzip\r\n"
+               "Content-Length: %u\r\n"
+               "ETag: %s\r\n"
+               "Cache-Control: no-cache\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               (unsigned int)sse_html_size, sse_html_etag);
 
-    // Send header
-    send(client_sock, headers, strlen(headers), 0);
-
-    // Send file content
-    send(client_sock, sse_html_start, sse_html_size, 0);
+      // Send header and file content together
+      struct iovec iov[2] = {
+        { .iov_base = headers, .iov_len = headers_len },
+        { .iov_base = (void *)sse_html_gz_start, .iov_len = sse_html_size },
+      };
+      writev(client_sock, iov, 2);
+    }
   }
   // Check if the request is for the SSE endpoint
-  else if (strstr(request, "GET /log-events HTTP") != NULL) {
-    //printf("SSE client connected\n");
-    // Send SSE headers
-    const char *headers = "HTTP/1.1 200 OK\r\n"
-                              "Content-Type: text/event-stream\r\n"
-                              "retry: 1000\r\n"
-                              "Cache-Control: no-cache\r\n"
-                              "Connection: keep-alive\r\n"
-                              "Access-Control-Allow-Origin: *\r\n"
-                              "\r\n";
-
-    send(client_sock, headers, strlen(headers), 0);
-    //printf("serving SSE\n");
-
-    // Keep connection open and send SSE events
-    while ((xEventGroupGetBits(client_serving_task_events) & STOP_SERVING_CLIENT) == 0) {
-      #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-      size_t received;
-      char *buffer = (char *)xRingbufferReceive(xRingBufferSSE, &received, pdMS_TO_TICKS(10));
-      #else
-      char buffer[xItemSize];
-      size_t received = xMessageBufferReceive(xMessageBufferSSE, buffer, sizeof(buffer), pdMS_TO_TICKS(10));
-      #endif
+  else if (strncmp(request, "GET /log-events", 15) == 0 && (request[15] == ' ' || request[15] == '?')) {
+    int slot = sse_client_attach();
+    if (slot < 0) {
+      send(client_sock, sse_busy_response, strlen(sse_busy_response), 0);
+    } else {
+      //printf("SSE client connected\n");
+      // Send SSE headers
+      const char *headers = "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: text/event-stream\r\n"
+                                "retry: 1000\r\n"
+                                "Cache-Control: no-cache\r\n"
+                                "Connection: keep-alive\r\n"
+                                "Access-Control-Allow-Origin: *\r\n"
+                                "\r\n";
 
-      if (received > 0) {
-        // Format the buffer content as an SSE event
-        char sse_event[512];
-        snprintf(sse_event, sizeof(sse_event), "event: log-line\ndata: %.*s\n\n", (int)received, buffer);
+      send(client_sock, headers, strlen(headers), 0);
+      //printf("serving SSE\n");
 
-        #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-        vRingbufferReturnItem(xRingBufferSSE, (void *)buffer);
-        #endif
+      // Give up on a client that stops reading, instead of blocking forever
+      struct timeval timeout = { .tv_sec = 5 };
+      setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-        // Send the event
-        int ret = send(client_sock, sse_event, strlen(sse_event), 0);
-        if (ret < 0) {
+      // Only send what the query string asks for, e.g. /log-events?level=W&tag=wifi,MAIN&grep=error
+      SSE_FILTER_t filter;
+      sse_filter_parse(&filter, (request[15] == '?') ? &request[16] : "");
+
+      // A reconnecting browser continues after the last event it has seen
+      SSE_CURSOR_t cursor;
+      const char *last_event_id = sse_find_header(request, "Last-Event-ID");
+      if (last_event_id != NULL) {
+        sse_ring_cursor_seek(&cursor, strtoul(last_event_id, NULL, 10));
+      } else {
+        sse_ring_cursor_init(&cursor);
+      }
+
+      // Keep connection open and send SSE events.
+      // Everything the cursor can reach is sent with one writev() per wakeup.
+      SSE_BATCH_t batch = { 0 };
+      while (1) {
+        while (batch.iovcnt + SSE_EVENT_IOV <= SSE_BATCH_IOV &&
+               SSE_BATCH_DATA - batch.data_len >= xItemSize + SSE_EVENT_HEADER) {
+          char *payload = batch.data + batch.data_len;
+          SSE_RECORD_t record;
+          uint32_t lost;
+          size_t received = sse_ring_get(&cursor, &filter, payload, xItemSize, &record, &lost);
+          batch.data_len += received;
+
+          // Tell the browser how many records it has missed, 0 if unknown
+          if (lost != 0) sse_batch_add_gap(&batch, (lost == SSE_LOST_UNKNOWN) ? 0 : lost);
+          if (received == 0) break;
+          sse_batch_add_event(&batch, record.seq, payload, received);
+        }
+
+        if (batch.iovcnt == 0) {
+          // Sleep until the dispatcher has new logs
+          if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SSE_KEEPALIVE_MS)) == 0) {
+            // Nothing was logged for a while.
+            // Send a comment line, which also finds out if the browser has gone away.
+            if (send(client_sock, ":\n\n", 3, 0) < 0) break;
+          }
+          continue;
+        }
+
+        if (sse_batch_send(client_sock, &batch) != ESP_OK) {
           // printf("Error sending SSE event: errno %d\n", errno);
           break;
         }
       }
+      sse_client_detach(slot);
     }
-  } else {
+  }
+  // Check if the request is for the pipeline statistics, see net_logging_get_stats()
+  else if (strncmp(request, "GET /stats", 10) == 0 && (request[10] == ' ' || request[10] == '?')) {
+    char body[SSE_STATS_SIZE];
+    size_t body_len = logging_stats_json(body, sizeof(body));
+    char headers[192];
+    int headers_len = snprintf(headers, sizeof(headers),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: application/json\r\n"
+             "Content-Length: %u\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             (unsigned int)body_len);
+    struct iovec iov[2] = {
+      { .iov_base = headers, .iov_len = headers_len },
+      { .iov_base = body, .iov_len = body_len },
+    };
+    writev(client_sock, iov, 2);
+  }
+#if CONFIG_LOG_SSE_WEBSOCKET
+  // Check if the request is for the WebSocket endpoint
+  else if (strncmp(request, "GET /log-ws", 11) == 0 && (request[11] == ' ' || request[11] == '?')) {
+    int slot = sse_client_attach();
+    if (slot < 0) {
+      send(client_sock, sse_busy_response, strlen(sse_busy_response), 0);
+    } else {
+      if (ws_handshake(client_sock, request) == ESP_OK) {
+        // Give up on a client that stops reading, instead of blocking forever
+        struct timeval timeout = { .tv_sec = 5 };
+        setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        ws_serve(client_sock, (request[11] == '?') ? &request[12] : "");
+      } else {
+        const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 11\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "Bad Request";
+        send(client_sock, bad_request, strlen(bad_request), 0);
+      }
+      sse_client_detach(slot);
+    }
+  }
+#endif
+  else {
     // Not found response for other paths
     const char *not_found = "HTTP/1.1 404 Not Found\r\n"
     "Content-Type: text/plain\r\n"
@@ -140,7 +937,6 @@ void serve_client(void *pvParameters) {
   //printf("closing connection\n");
   shutdown(client_sock, 0);
   close(client_sock);
-  xEventGroupSetBits(client_serving_task_events, STOPPED_SERVING_CLIENT );
   vTaskDelete(NULL);
 }
 
@@ -162,6 +958,7 @@ void sse_server(void *pvParameters) {
   int server_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
   if (server_sock < 0) {
     printf("Unable to create socket: errno %d\n", errno);
+    logging_failed(NET_LOGGING_SSE);
     vTaskDelete(NULL);
   }
 
@@ -175,6 +972,7 @@ void sse_server(void *pvParameters) {
   if (err != 0) {
     printf("Socket unable to bind: errno %d\n", errno);
     close(server_sock);
+    logging_failed(NET_LOGGING_SSE);
     vTaskDelete(NULL);
   }
 
@@ -183,56 +981,47 @@ void sse_server(void *pvParameters) {
   if (err != 0) {
     printf("Error listening on socket: errno %d\n", errno);
     close(server_sock);
+    logging_failed(NET_LOGGING_SSE);
     vTaskDelete(NULL);
   }
 
   printf("SSE Server listening on port %d\n", param.port);
 
-  // Send ready to receive notify
-  xTaskNotifyGive(param.taskHandle);
+  // The page never changes while running, so its ETag is computed once
+  snprintf(sse_html_etag, sizeof(sse_html_etag), "\"%08"PRIx32"-%x\"",
+           sse_hash((const char *)sse_html_gz_start, sse_html_gz_end - sse_html_gz_start),
+           (unsigned int)(sse_html_gz_end - sse_html_gz_start));
+
+  // Start copying logs into the shared ring
+  sse_ring_lock = xSemaphoreCreateMutex();
+  configASSERT( sse_ring_lock );
+  xTaskCreate(sse_dispatch, "SSE DISPATCH", 1024*2, NULL, 2, NULL);
+
+  // Ready only now that the dispatcher takes the logs into the ring
+  logging_ready(NET_LOGGING_SSE, param.taskHandle);
 
   // Main server loop
-  static EventGroupHandle_t client_serving_task_events;
-  StaticEventGroup_t client_serving_task_events_data;
-  client_serving_task_events = xEventGroupCreateStatic( &client_serving_task_events_data );
-  TaskHandle_t client_task = NULL;
-  static int client_sock;
   while (1) {
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+    int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
     if (client_sock < 0) {
       //printf("Unable to accept connection: errno %d\n", errno);
       continue;
     }
 
-    // Stop serving the previous client, if any
-    if (client_task != NULL) {
-      xEventGroupSetBits(client_serving_task_events, STOP_SERVING_CLIENT );
-      xEventGroupWaitBits(
-        client_serving_task_events,
-        STOPPED_SERVING_CLIENT,
-        pdTRUE,
-        pdFALSE,
-        portMAX_DELAY
-      );
-      client_task = NULL;
-    }
-
-    // serve new client
-    xEventGroupClearBits(client_serving_task_events, STOP_SERVING_CLIENT | STOPPED_SERVING_CLIENT );
-    void* client_pvParams[] = {
-      (void*)&client_sock,
-      (void*)&client_serving_task_events
-    };
-    xTaskCreate(
+    // Serve each client in its own task
+    BaseType_t created = xTaskCreate(
       serve_client,
       "LOGS_SSE_SERVE_CLIENT",
-      1024*4,
-      (void*) client_pvParams,
+      1024*6,
+      (void*)(intptr_t)client_sock,
       2,
-      &client_task
+      NULL
     );
+    if (created != pdPASS) {
+      close(client_sock);
+    }
   }
 
   if (server_sock != -1) {
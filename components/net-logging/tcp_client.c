@@ -19,41 +19,45 @@
 #endif
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lwip/sockets.h"
 #include "netdb.h" // gethostbyname
 
 #include "net_logging.h"
+#include "log_record.h"
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-extern RingbufHandle_t xRingBufferTCP;
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
 #else
-extern MessageBufferHandle_t xMessageBufferTCP;
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
 #endif
 
-void tcp_client(void *pvParameters)
-{
-	PARAMETER_t *task_parameter = pvParameters;
-	PARAMETER_t param;
-	memcpy((char *)&param, task_parameter, sizeof(PARAMETER_t));
-	printf("Start:param.port=%d param.ipv4=[%s]\n", param.port, param.ipv4);
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
 
+void logging_ready(int sink, TaskHandle_t taskHandle);
+bool logging_retry(int sink, int *attempt);
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void));
+
+// Returns the connected socket, or -1
+static int tcp_connect(PARAMETER_t *param)
+{
 	int addr_family = 0;
 	int ip_protocol = 0;
 
 	struct sockaddr_in dest_addr;
-	dest_addr.sin_addr.s_addr = inet_addr(param.ipv4);
+	dest_addr.sin_addr.s_addr = inet_addr(param->ipv4);
 	dest_addr.sin_family = AF_INET;
-	dest_addr.sin_port = htons(param.port);
+	dest_addr.sin_port = htons(param->port);
 	addr_family = AF_INET;
 	ip_protocol = IPPROTO_IP;
 
 	printf("dest_addr.sin_addr.s_addr=0x%"PRIx32"\n", dest_addr.sin_addr.s_addr);
 	if (dest_addr.sin_addr.s_addr == 0xffffffff) {
 		struct hostent *hp;
-		hp = gethostbyname(param.ipv4);
+		hp = gethostbyname(param->ipv4);
 		if (hp == NULL) {
 			printf("FTP Client Error: Connect, gethostbyname\n");
-			vTaskDelete(NULL);
+			return -1;
 		}
 		struct ip4_addr *ip4_addr;
 		ip4_addr = (struct ip4_addr *)hp->h_addr;
@@ -65,37 +69,90 @@ void tcp_client(void *pvParameters)
 	int sock = socket(addr_family, SOCK_STREAM, ip_protocol);
 	if (sock < 0) {
 		//ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-		vTaskDelete(NULL);
+		return -1;
 	}
-	printf("Socket created, connecting to %s:%d\n", param.ipv4, param.port);
+	printf("Socket created, connecting to %s:%d\n", param->ipv4, param->port);
 
 	int err = connect(sock, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in6));
 	if (err == 0) {
 		printf("Successfully connected\n");
 	} else {
 		printf("Socket unable to connect: errno %d\n", errno);
-		vTaskDelete(NULL);
+		close(sock);
+		return -1;
 	}
+	return sock;
+}
+
+static int tcp_sock;
+#if CONFIG_LOG_TCP_BINARY
+static LOG_RECORD_TAGS_t tcp_tags;
+#endif
 
-	// Send ready to receive notify
-	xTaskNotifyGive(param.taskHandle);
+// Send one log, called by the task and by net_logging_flush()
+static bool tcp_send(const void *data, size_t len) {
+#if CONFIG_LOG_TCP_BINARY
+	uint8_t definition[LOG_RECORD_DEFINE_SIZE];
+	size_t definition_len = log_record_tags_check(&tcp_tags, data, len, definition, sizeof(definition));
+	if (definition_len > 0) {
+		send(tcp_sock, definition, definition_len, 0);
+	}
+#endif
+	return send(tcp_sock, data, len, 0) == len;
+}
+
+void tcp_client(void *pvParameters)
+{
+	PARAMETER_t *task_parameter = pvParameters;
+	PARAMETER_t param;
+	memcpy((char *)&param, task_parameter, sizeof(PARAMETER_t));
+	printf("Start:param.port=%d param.ipv4=[%s]\n", param.port, param.ipv4);
+
+	int attempt = 0;
+	while ((tcp_sock = tcp_connect(&param)) < 0) {
+		if (!logging_retry(NET_LOGGING_TCP, &attempt)) vTaskDelete(NULL);
+	}
+
+#if CONFIG_LOG_TCP_BINARY
+	// Each tag is defined once on this connection
+	log_record_tags_init(&tcp_tags, 0);
+#endif
+	logging_flusher(NET_LOGGING_TCP, tcp_send, NULL);
+
+	logging_ready(NET_LOGGING_TCP, param.taskHandle);
 
 	while (1) {
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
         size_t received;
-        char *buffer = (char *)xRingbufferReceive(xRingBufferTCP, &received, portMAX_DELAY);
+        RingbufHandle_t from;
+        char *buffer = (char *)logging_receive(NET_LOGGING_TCP, &received, portMAX_DELAY, &from);
         //printf("xRingBufferReceive received=%d\n", received);
 #else
 		char buffer[xItemSize];
-		size_t received = xMessageBufferReceive(xMessageBufferTCP, buffer, sizeof(buffer), portMAX_DELAY);
+		size_t received = logging_receive(NET_LOGGING_TCP, buffer, sizeof(buffer), portMAX_DELAY);
 		//printf("xMessageBufferReceive received=%d\n", received);
 #endif
 		if (received > 0) {
 			//printf("xMessageBufferReceive buffer=[%.*s]\n",received, buffer);
-			int ret = send(sock, buffer, received, 0);
-			LWIP_ASSERT("ret == received", ret == received);
+			int64_t start = esp_timer_get_time();
+			while (!tcp_send(buffer, received)) {
+				// The connection is lost. Connect again and send the log on the new connection.
+				printf("Socket unable to send: errno %d\n", errno);
+				shutdown(tcp_sock, 0);
+				close(tcp_sock);
+				attempt = 0;
+				while ((tcp_sock = tcp_connect(&param)) < 0) {
+					logging_retry(NET_LOGGING_TCP, &attempt);
+				}
+#if CONFIG_LOG_TCP_BINARY
+				// The receiver on the new connection has not seen any tag
+				log_record_tags_reset(&tcp_tags);
+#endif
+				logging_ready(NET_LOGGING_TCP, param.taskHandle);
+			}
+			logging_stats_sent(NET_LOGGING_TCP, 1, received, start);
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-            vRingbufferReturnItem(xRingBufferTCP, (void *)buffer);
+            vRingbufferReturnItem(from, (void *)buffer);
 #endif
 		} else {
 			//printf("xMessageBufferReceive fail\n");
@@ -103,10 +160,10 @@ void tcp_client(void *pvParameters)
 		} // end if
 	} // end while
 
-	if (sock != -1) {
+	if (tcp_sock != -1) {
 		//ESP_LOGE(TAG, "Shutting down socket and restarting...");
-		shutdown(sock, 0);
-		close(sock);
+		shutdown(tcp_sock, 0);
+		close(tcp_sock);
 	}
 	vTaskDelete(NULL);
 }
@@ -19,16 +19,28 @@
 #endif
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lwip/sockets.h"
 
 #include "net_logging.h"
+#include "log_record.h"
+
+#ifndef CONFIG_NET_LOGGING_TAG_INTERVAL
+#define CONFIG_NET_LOGGING_TAG_INTERVAL 60
+#endif
 
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-extern RingbufHandle_t xRingBufferUDP;
+void *logging_receive(int sink, size_t *received, TickType_t xTicksToWait, RingbufHandle_t *from);
 #else
-extern MessageBufferHandle_t xMessageBufferUDP;
+size_t logging_receive(int sink, void *data, size_t size, TickType_t xTicksToWait);
 #endif
 
+void logging_stats_sent(int sink, uint32_t records, size_t len, int64_t start);
+void logging_stats_dropped(int sink, uint32_t records);
+void logging_ready(int sink, TaskHandle_t taskHandle);
+bool logging_retry(int sink, int *attempt);
+void logging_flusher(int sink, bool (*send)(const void *data, size_t len), void (*finish)(void));
+
 void udp_dump(char *id, char *data, int len)
 {
   int i;
@@ -40,6 +52,32 @@ void udp_dump(char *id, char *data, int len)
   printf("\n");
 }
 
+static int udp_fd;
+static struct sockaddr_in udp_addr;
+#if CONFIG_LOG_UDP_BINARY
+static LOG_RECORD_TAGS_t udp_tags;
+#endif
+
+// Send one log, called by the task and by net_logging_flush()
+static bool udp_send(const void *data, size_t len) {
+#if CONFIG_LOG_UDP_BINARY
+	// A new tag is defined in a datagram of its own
+	uint8_t definition[LOG_RECORD_DEFINE_SIZE];
+	size_t definition_len = log_record_tags_check(&udp_tags, data, len, definition, sizeof(definition));
+	bool sent = true;
+	if (definition_len > 0) {
+		sent = lwip_sendto(udp_fd, definition, definition_len, 0, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == definition_len;
+	}
+	if (sent) sent = lwip_sendto(udp_fd, data, len, 0, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == len;
+	// The tags are defined again once the network is back
+	if (!sent) log_record_tags_reset(&udp_tags);
+	return sent;
+#else
+	// Fails while the network is not up, e.g. before the ESP32 has an IP address
+	return lwip_sendto(udp_fd, data, len, 0, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == len;
+#endif
+}
+
 // UDP Client Task
 void udp_client(void *pvParameters) {
 	PARAMETER_t *task_parameter = pvParameters;
@@ -47,40 +85,56 @@ void udp_client(void *pvParameters) {
 	memcpy((char *)&param, task_parameter, sizeof(PARAMETER_t));
 	//printf("Start:param.port=%d param.ipv4=[%s]\n", param.port, param.ipv4);
 
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(param.port);
-	//addr.sin_addr.s_addr = htonl(INADDR_BROADCAST); /* send message to 255.255.255.255 */
-	//addr.sin_addr.s_addr = inet_addr("255.255.255.255"); /* send message to 255.255.255.255 */
-	addr.sin_addr.s_addr = inet_addr(param.ipv4);
+	memset(&udp_addr, 0, sizeof(udp_addr));
+	udp_addr.sin_family = AF_INET;
+	udp_addr.sin_port = htons(param.port);
+	//udp_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST); /* send message to 255.255.255.255 */
+	//udp_addr.sin_addr.s_addr = inet_addr("255.255.255.255"); /* send message to 255.255.255.255 */
+	udp_addr.sin_addr.s_addr = inet_addr(param.ipv4);
 
 	/* create the socket */
-	int fd;
 	int ret;
-	fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP ); // Create a UDP socket.
-	LWIP_ASSERT("fd >= 0", fd >= 0);
+	udp_fd = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP ); // Create a UDP socket.
+	LWIP_ASSERT("fd >= 0", udp_fd >= 0);
 
-	// Send ready to receive notify
-	xTaskNotifyGive(param.taskHandle);
+#if CONFIG_LOG_UDP_BINARY
+	// There is no connection, a receiver may start at any time
+	log_record_tags_init(&udp_tags, pdMS_TO_TICKS(CONFIG_NET_LOGGING_TAG_INTERVAL * 1000));
+#endif
+	logging_flusher(NET_LOGGING_UDP, udp_send, NULL);
+
+	// There is no connection to wait for
+	logging_ready(NET_LOGGING_UDP, param.taskHandle);
 
 	while(1) {
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
 		size_t received;
-		char *buffer = (char *)xRingbufferReceive(xRingBufferUDP, &received, portMAX_DELAY);
+		RingbufHandle_t from;
+		char *buffer = (char *)logging_receive(NET_LOGGING_UDP, &received, portMAX_DELAY, &from);
 		//printf("xRingBufferReceive received=%d\n", received);
 #else
 		char buffer[xItemSize];
-		size_t received = xMessageBufferReceive(xMessageBufferUDP, buffer, sizeof(buffer), portMAX_DELAY);
+		size_t received = logging_receive(NET_LOGGING_UDP, buffer, sizeof(buffer), portMAX_DELAY);
 		//printf("xMessageBufferReceive received=%d\n", received);
 #endif
 		if (received > 0) {
+			int64_t start = esp_timer_get_time();
 			//printf("xMessageBufferReceive buffer=[%.*s]\n",received, buffer);
 			//udp_dump("buffer", buffer, received);
-			ret = lwip_sendto(fd, buffer, received, 0, (struct sockaddr *)&addr, sizeof(addr));
-			LWIP_ASSERT("ret == received", ret == received);
+			// The same log is sent again while the network is not up, the logs made meanwhile wait in the buffer
+			int attempt = 0;
+			bool sent;
+			while (!(sent = udp_send(buffer, received))) {
+				if (!logging_retry(NET_LOGGING_UDP, &attempt)) break;
+			}
+			if (sent) {
+				if (attempt > 0) logging_ready(NET_LOGGING_UDP, param.taskHandle);
+				logging_stats_sent(NET_LOGGING_UDP, 1, received, start);
+			} else {
+				logging_stats_dropped(NET_LOGGING_UDP, 1);
+			}
 #if CONFIG_NET_LOGGING_USE_RINGBUFFER
-			vRingbufferReturnItem(xRingBufferUDP, (void *)buffer);
+			vRingbufferReturnItem(from, (void *)buffer);
 #endif
 		} else {
 			printf("xMessageBufferReceive fail\n");
@@ -123,9 +177,8 @@ buffer NOT included escape code
 */
 
 	// Close socket
-	ret = lwip_close(fd);
+	ret = lwip_close(udp_fd);
 	LWIP_ASSERT("ret == 0", ret == 0);
 	vTaskDelete( NULL );
 
 }
-
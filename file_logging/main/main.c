@@ -0,0 +1,91 @@
+/* The example of ESP-IDF net-logging to files
+ *
+ * This sample code is in the public domain.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_spiffs.h"
+#endif
+
+#include "net_logging.h"
+
+static const char *TAG = "MAIN";
+
+#if CONFIG_ENABLE_FILE_LOG
+#if !CONFIG_IDF_TARGET_LINUX
+static void mount_spiffs(void)
+{
+	esp_vfs_spiffs_conf_t conf = {
+		.base_path = CONFIG_LOG_FILE_DIRECTORY,
+		.partition_label = "storage",
+		.max_files = 5,
+		.format_if_mount_failed = true
+	};
+	ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));
+
+	size_t total = 0, used = 0;
+	ESP_ERROR_CHECK(esp_spiffs_info(conf.partition_label, &total, &used));
+	ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+}
+#endif
+
+// Use printf so that the list itself doesn't go into the log files
+static void list_files(void)
+{
+	DIR *dir = opendir(CONFIG_LOG_FILE_DIRECTORY);
+	if (dir == NULL) return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		char path[300];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", CONFIG_LOG_FILE_DIRECTORY, entry->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			printf("%s %ld bytes\n", path, (long)st.st_size);
+		}
+	}
+	closedir(dir);
+}
+#endif
+
+void app_main()
+{
+#if CONFIG_ENABLE_FILE_LOG && !CONFIG_IDF_TARGET_LINUX
+	// On the linux target, the log files are written to a directory of the host
+	mount_spiffs();
+#endif
+
+	int16_t write_to_stdout = 0;
+#if CONFIG_WRITE_TO_STDOUT
+	ESP_LOGI(TAG, "Enable write Logging to STDOUT");
+	write_to_stdout = 1;
+#endif
+
+#if CONFIG_ENABLE_FILE_LOG
+	ESP_ERROR_CHECK(file_logging_init( CONFIG_LOG_FILE_DIRECTORY, write_to_stdout ));
+#endif // CONFIG_ENABLE_FILE_LOG
+
+	ESP_LOGI(TAG, "This is info level");
+	ESP_LOGW(TAG, "This is warning level");
+	ESP_LOGE(TAG, "This is error level");
+
+	// Fill a few files to see the rotation
+	for (int i = 0; i < 1000; i++) {
+		ESP_LOGI(TAG, "This is line %d", i);
+		if ((i % 10) == 9) vTaskDelay(pdMS_TO_TICKS(20));
+	}
+
+#if CONFIG_ENABLE_FILE_LOG
+	// Wait until the last batch has been written
+	vTaskDelay(pdMS_TO_TICKS((CONFIG_LOG_FILE_FLUSH_INTERVAL + 1) * 1000));
+	list_files();
+#endif
+}
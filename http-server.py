@@ -13,6 +13,10 @@ import argparse
 
 class class1(BaseHTTPRequestHandler):
 	def do_POST(self):
+		if self.headers.get("transfer-encoding", "").lower() == "chunked":
+			self.do_POST_chunked()
+			return
+
 		#parsed = urlparse(self.path)
 		#print("parsed={}".format(parsed))
 		#params = parse_qs(parsed.query)
@@ -30,6 +34,29 @@ class class1(BaseHTTPRequestHandler):
 		self.end_headers()
 		self.wfile.write(body.encode())
 
+	# Streaming mode: print each chunk as soon as it arrives
+	def do_POST_chunked(self):
+		while True:
+			line = self.rfile.readline()
+			if not line:
+				return
+			chunk_len = int(line.split(b";")[0].strip(), 16)
+			if chunk_len == 0:
+				# Skip trailers up to the final empty line
+				while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+					pass
+				break
+			chunk = self.rfile.read(chunk_len).decode("utf-8", errors="replace")
+			self.rfile.readline() # CRLF after chunk data
+			print("{}".format(chunk), end='', flush=True)
+
+		body = "OK"
+		self.send_response(200)
+		self.send_header('Content-type', 'text/html; charset=utf-8')
+		self.send_header('Content-length', len(body.encode()))
+		self.end_headers()
+		self.wfile.write(body.encode())
+
 if __name__=='__main__':
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--port', type=int, help='tcp port', default=8000)
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# Decode the binary log records, see components/net-logging/log_record.h
+#
+# python3 log_record.py logs/log.0 logs/log.1
+# mosquitto_sub -h broker.emqx.io -t /esp32/logging -N | python3 log_record.py
+
+import sys
+import os
+import argparse
+import datetime
+
+LOG_RECORD_LOG = 1
+LOG_RECORD_TAG = 2
+LOG_RECORD_TIME = 3
+LEVELS = '-EWIDV'
+
+def varint(data, offset):
+	value = 0
+	shift = 0
+	while True:
+		if offset >= len(data):
+			raise IndexError('varint')
+		byte = data[offset]
+		offset += 1
+		value |= (byte & 0x7f) << shift
+		shift += 7
+		if byte < 0x80:
+			return value, offset
+
+def string(data, offset):
+	size = data[offset]
+	return data[offset + 1:offset + 1 + size].decode(errors='replace'), offset + 1 + size
+
+class Decoder:
+	def __init__(self):
+		# Tag names by ID, from the LOG_RECORD_TAG records
+		self.tags = {}
+		# UTC in microseconds when esp_timer was 0, from the LOG_RECORD_TIME record
+		self.boot_utc = None
+		# The start of a record that is not complete yet
+		self.rest = b''
+
+	def parse(self, body):
+		record = {'type': body[0]}
+		if body[0] == LOG_RECORD_TAG:
+			tag_id, offset = varint(body, 1)
+			self.tags[tag_id] = body[offset:].decode(errors='replace')
+		if body[0] == LOG_RECORD_TIME:
+			self.boot_utc, offset = varint(body, 1)
+		if body[0] != LOG_RECORD_LOG:
+			return record
+		record['timestamp'], offset = varint(body, 1)
+		record['utc'] = None
+		if self.boot_utc is not None:
+			record['utc'] = self.boot_utc + record['timestamp']
+		record['level'] = body[offset]
+		record['core'] = body[offset + 1]
+		tag_id, offset = varint(body, offset + 2)
+		if tag_id == 0:
+			record['tag'], offset = string(body, offset)
+		else:
+			record['tag'] = self.tags.get(tag_id, '#{}'.format(tag_id))
+		record['task'], offset = string(body, offset)
+		record['message'] = body[offset:].decode(errors='replace')
+		return record
+
+	# Returns the records completed by data
+	def decode(self, data):
+		data = self.rest + data
+		records = []
+		offset = 0
+		while offset < len(data):
+			try:
+				size, start = varint(data, offset)
+			except IndexError:
+				break
+			if start + size > len(data):
+				break
+			records.append(self.parse(data[start:start + size]))
+			offset = start + size
+		self.rest = data[offset:]
+		return records
+
+# Same as the text of the ESP32, without colors.
+# The time is UTC once the ESP32 knows it, milliseconds since boot before that.
+def format(record, details=False):
+	if record['type'] != LOG_RECORD_LOG:
+		return None
+	if record['level'] == 0:
+		return record['message']
+	level = LEVELS[record['level']] if record['level'] < len(LEVELS) else '?'
+	if record['utc'] is not None:
+		time = datetime.datetime.fromtimestamp(record['utc'] / 1000000, datetime.timezone.utc).strftime('%Y-%m-%d %H:%M:%S.%f')
+	else:
+		time = record['timestamp'] // 1000
+	if details:
+		return "{} ({}) {}: [{}/{}] {}".format(level, time, record['tag'], record['task'], record['core'], record['message'])
+	return "{} ({}) {}: {}".format(level, time, record['tag'], record['message'])
+
+def show(records, details):
+	for record in records:
+		text = format(record, details)
+		if text is not None:
+			print(text, flush=True)
+
+if __name__ == "__main__":
+	parser = argparse.ArgumentParser()
+	parser.add_argument('files', nargs='*', help='files of records, stdin when none')
+	parser.add_argument('--details', action='store_true', help='show task and core')
+	args = parser.parse_args()
+
+	if args.files:
+		for name in args.files:
+			# Each file has the tag definitions it needs
+			with open(name, 'rb') as f:
+				show(Decoder().decode(f.read()), args.details)
+	else:
+		decoder = Decoder()
+		while True:
+			data = os.read(sys.stdin.fileno(), 4096)
+			if not data:
+				break
+			show(decoder.decode(data), args.details)
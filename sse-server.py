@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Local stand-in for the ESP32 SSE server.
+# It serves the viewer page and streams generated log lines at a fixed rate,
+# so that the viewer can be checked under load without a device.
+
+from http.server import ThreadingHTTPServer
+from http.server import BaseHTTPRequestHandler
+import argparse
+import os
+import time
+
+LEVELS = [("I", "32"), ("I", "32"), ("I", "32"), ("W", "33"), ("E", "31")]
+TAGS = ["MAIN", "wifi", "esp_netif_handlers", "app_sensor"]
+
+class class1(BaseHTTPRequestHandler):
+	def do_GET(self):
+		path = self.path.split("?")[0]
+		if path == "/":
+			self.send_page()
+		elif path == "/log-events":
+			self.send_events()
+		else:
+			self.send_error(404)
+
+	def send_page(self):
+		html = os.path.join(os.path.dirname(os.path.abspath(__file__)), "components", "net-logging", "assets", "sse.html")
+		with open(html, "rb") as f:
+			body = f.read()
+		self.send_response(200)
+		self.send_header("Content-Type", "text/html; charset=utf-8")
+		self.send_header("Content-Length", len(body))
+		self.end_headers()
+		self.wfile.write(body)
+
+	def send_events(self):
+		self.send_response(200)
+		self.send_header("Content-Type", "text/event-stream")
+		self.send_header("Cache-Control", "no-cache")
+		self.end_headers()
+
+		seq = int(self.headers.get("Last-Event-ID", "-1")) + 1
+		interval = 0.01
+		budget = 0.0
+		start = time.monotonic()
+		next_tick = start
+		try:
+			while True:
+				# Lines due in this tick
+				budget += args.rate * interval
+				lines = int(budget)
+				budget -= lines
+				events = []
+				for _ in range(lines):
+					level, color = LEVELS[seq % len(LEVELS)]
+					tag = TAGS[seq % len(TAGS)]
+					uptime = int((time.monotonic() - start) * 1000)
+					text = "\033[0;{}m{} ({}) {}: line {} {}\033[0m".format(color, level, uptime, tag, seq, "x" * (seq % 80))
+					events.append("id: {}\nevent: log-line\ndata: {}\n\n".format(seq, text))
+					seq += 1
+				self.wfile.write("".join(events).encode("utf-8"))
+				self.wfile.flush()
+
+				next_tick += interval
+				time.sleep(max(0, next_tick - time.monotonic()))
+		except (BrokenPipeError, ConnectionResetError):
+			pass
+
+	def log_message(self, format, *args):
+		pass
+
+if __name__=='__main__':
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--port', type=int, help='tcp port', default=8080)
+	parser.add_argument('--rate', type=int, help='lines per second', default=5000)
+	args = parser.parse_args()
+	print("args.port={} args.rate={}".format(args.port, args.rate))
+
+	print("+===========================+")
+	print("| ESP32 SSE Stand-in Server |")
+	print("+===========================+")
+	print("")
+	server = ThreadingHTTPServer(('0.0.0.0', args.port), class1)
+
+	server.serve_forever()
@@ -4,6 +4,7 @@ import signal
 import socket
 import select
 import argparse
+import log_record
 
 def handler(signal, frame):
 	global running
@@ -16,6 +17,8 @@ if __name__ == "__main__":
 
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--port', type=int, help='tcp port', default=8080)
+	parser.add_argument('--binary', action='store_true', help='decode binary records')
+	parser.add_argument('--details', action='store_true', help='show task and core of binary records')
 	args = parser.parse_args()
 	print("args.port={}".format(args.port))
 
@@ -36,11 +39,16 @@ if __name__ == "__main__":
 	#print("Connected!! [ Source : {}]".format(address))
 	client.setblocking(0)
 
+	# A record may be split over several receives
+	decoder = log_record.Decoder()
 	while running:
 		ready = select.select([client], [], [], 1)
 		#print("ready={}".format(ready[0]))
 		if ready[0]:
 			data = client.recv(buffer_size)
+			if args.binary:
+				log_record.show(decoder.decode(data), args.details)
+				continue
 			if (type(data) is bytes):
 				data = data.decode('utf-8')
 				#print("[*] Received Data : {}".format(data))
@@ -4,10 +4,13 @@
 import sys
 import select, socket
 import argparse
+import log_record
 
 if __name__ == "__main__":
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--port', type=int, help='udp port', default=6789)
+	parser.add_argument('--binary', action='store_true', help='decode binary records')
+	parser.add_argument('--details', action='store_true', help='show task and core of binary records')
 	args = parser.parse_args()
 	print("args.port={}".format(args.port))
 
@@ -23,9 +26,14 @@ if __name__ == "__main__":
 	print("+==========================+")
 	print("")
 
+	decoder = log_record.Decoder()
 	while True:
 		result = select.select([sock],[],[])
 		data = result[0][0].recv(1024)
+		if args.binary:
+			# One record in each datagram
+			log_record.show(decoder.decode(data), args.details)
+			continue
 		if (type(data) is bytes):
 			data = data.decode('utf-8')
 		print(data, end='')
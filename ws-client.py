@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+
+import sys
+import os
+import signal
+import socket
+import select
+import struct
+import base64
+import argparse
+
+def handler(signal, frame):
+	global running
+	#print('handler')
+	running = False
+
+def send_frame(sock, opcode, payload):
+	# Client frames must be masked
+	mask = os.urandom(4)
+	header = bytes([0x80 | opcode])
+	if len(payload) < 126:
+		header += bytes([0x80 | len(payload)])
+	else:
+		header += bytes([0x80 | 126]) + struct.pack('>H', len(payload))
+	masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+	sock.sendall(header + mask + masked)
+
+def recv_exact(sock, size):
+	data = b''
+	while len(data) < size:
+		chunk = sock.recv(size - len(data))
+		if not chunk:
+			raise ConnectionError('connection closed')
+		data += chunk
+	return data
+
+def recv_frame(sock):
+	header = recv_exact(sock, 2)
+	opcode = header[0] & 0x0f
+	size = header[1] & 0x7f
+	if size == 126:
+		size = struct.unpack('>H', recv_exact(sock, 2))[0]
+	elif size == 127:
+		size = struct.unpack('>Q', recv_exact(sock, 8))[0]
+	return opcode, recv_exact(sock, size)
+
+if __name__ == "__main__":
+	signal.signal(signal.SIGINT, handler)
+	running = True
+
+	parser = argparse.ArgumentParser()
+	parser.add_argument('host', help='ip address of the ESP32')
+	parser.add_argument('--port', type=int, help='sse server port', default=8080)
+	parser.add_argument('--query', help='filter, e.g. level=W&tag=wifi', default='')
+	parser.add_argument('--text', action='store_true', help='receive text frames instead of binary records')
+	args = parser.parse_args()
+	print("args.host={}".format(args.host))
+	print("args.port={}".format(args.port))
+
+	print("+================================+")
+	print("| ESP32 WebSocket Logging Client |")
+	print("+================================+")
+	print("Type pause, resume or filter level=W&tag=wifi and press Enter")
+	print("")
+
+	query = args.query
+	if args.text:
+		query = 'format=text&' + query if query else 'format=text'
+	path = '/log-ws?' + query if query else '/log-ws'
+
+	sock = socket.create_connection((args.host, args.port))
+	key = base64.b64encode(os.urandom(16)).decode()
+	request = "GET {} HTTP/1.1\r\nHost: {}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: {}\r\nSec-WebSocket-Version: 13\r\n\r\n".format(path, args.host, key)
+	sock.sendall(request.encode())
+	response = b''
+	while b'\r\n\r\n' not in response:
+		chunk = sock.recv(1)
+		if not chunk:
+			break
+		response += chunk
+	if not response.startswith(b'HTTP/1.1 101'):
+		print(response.decode(errors='replace'))
+		sys.exit(1)
+
+	while running:
+		ready = select.select([sock, sys.stdin], [], [], 1)
+		if sys.stdin in ready[0]:
+			command = sys.stdin.readline().strip()
+			if command:
+				send_frame(sock, 0x1, command.encode())
+		if sock in ready[0]:
+			try:
+				opcode, payload = recv_frame(sock)
+			except ConnectionError:
+				break
+			if opcode == 0x1:
+				# Log lines, or {"gap":N}
+				print(payload.decode(errors='replace'), end='' if payload.endswith(b'\n') else '\n')
+			elif opcode == 0x2:
+				# seq, length, level and text of each record
+				offset = 0
+				while offset + 7 <= len(payload):
+					seq, size, level = struct.unpack_from('<IHB', payload, offset)
+					offset += 7
+					text = payload[offset:offset + size].decode(errors='replace')
+					offset += size
+					#print("[{}] {}".format(seq, chr(level)), end=' ')
+					print(text, end='' if text.endswith('\n') else '\n')
+			elif opcode == 0x9:
+				send_frame(sock, 0xA, payload)
+			elif opcode == 0x8:
+				break
+
+	send_frame(sock, 0x8, b'')
+	sock.close()